@@ -1,24 +1,166 @@
 #include <asm/io.h>
 #include <asm/msr.h>
+#include <asm/page.h>
 #include <asm/page_types.h>
+#include <asm/cpufeature.h>
 #include <asm/processor-flags.h>
 #include <asm-generic/bitops/instrumented-atomic.h>
 #include <asm-generic/getorder.h>
 #include <linux/bitops.h>
+#include <linux/bits.h>
+#include <linux/context_tracking.h>
+#include <linux/err.h>
 #include <linux/gfp.h>
 #include <linux/gfp_types.h>
+#include <linux/minmax.h>
 #include <linux/mm.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
 #include <linux/mutex.h>
 #include <linux/preempt.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
 #include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
 #include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/vtime.h>
+#include <linux/wait.h>
 #include "../include/cpu.h"
+#include "../include/io.h"
 #include "../include/memory.h"
+#include "../include/stats.h"
+#include "../include/trace.h"
 #include "../include/vm.h"
 #include "../include/yakvm.h"
 
-static atomic_t asid = ATOMIC_INIT(1);
+DEFINE_PER_CPU(struct host, yakvm_host);
+
+/*
+ * upper bound of the window, where the halted vcpu polls for the
+ * interrupt before sleeping, the window of each vcpu grows from
+ * *YAKVM_HALT_POLL_NS_START* and shrinks by the observed wake-up
+ * latency.
+ */
+#define YAKVM_HALT_POLL_NS_START        10000
+static unsigned int halt_poll_ns = 200000;
+module_param(halt_poll_ns, uint, 0644);
+
+/*
+ * The vcpus come from the slab cache as bundles, each with its *gvmcb*
+ * and *state* in one order-1 block. The bundles of the
+ * destroyed vcpus are kept in the pool, up to *vcpu_pool_size*, and
+ * handed to the new vcpus without going back to the page allocator.
+ */
+#define YAKVM_VCPU_BUNDLE_ORDER         1
+static unsigned int vcpu_pool_size = 8;
+module_param(vcpu_pool_size, uint, 0444);
+
+static struct kmem_cache *yakvm_vcpu_cache;
+static struct vcpu **yakvm_vcpu_pool;
+static unsigned int yakvm_vcpu_pool_nr;
+static DEFINE_SPINLOCK(yakvm_vcpu_pool_lock);
+
+/* the reset *vmcb* copied into each new vcpu */
+static struct vmcb *yakvm_vmcb_template;
+
+/*
+ * *hsave* is a 4KB block of memory where *vmrun* saves part or
+ * none of host state, and from which *vmexit* reloads saving
+ * host state according to "15.30.4" on page 585 at
+ * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+ *
+ * Considering that *vmrun* and *vmexit* only saves part or none
+ * of host state, kernel should also use *vmcb* with
+ * *vmsave* and *vmload* to restore the totaly host state
+ * according to "15.5.1" on page 501 at
+ * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+ *
+ * Both of them only depend on the physical cpu, so they are
+ * shared by all vcpus running on the physical cpu.
+ */
+int yakvm_create_hosts(void)
+{
+        struct host *host;
+        int cpu;
+
+        for_each_possible_cpu(cpu) {
+                host = per_cpu_ptr(&yakvm_host, cpu);
+
+                /*
+                 * ASID 0 is reserved for the host, and the number of
+                 * ASIDs is reported by CPUID Fn8000_000A_EBX according
+                 * to "15.5.1" on page 503 at
+                 * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+                 *
+                 * The first allocation starts a new generation, which
+                 * flushes whatever is left in the TLB.
+                 */
+                host->max_asid = cpuid_ebx(0x8000000a) - 1;
+                host->next_asid = host->max_asid + 1;
+                host->asid_generation = 1;
+
+                host->hsave = (void *)get_zeroed_page(GFP_KERNEL);
+                host->vmcb = (void *)get_zeroed_page(GFP_KERNEL);
+                if (!host->hsave || !host->vmcb) {
+                        log(LOG_ERR, "get_zeroed_page() failed");
+                        yakvm_destroy_hosts();
+                        return -ENOMEM;
+                }
+        }
+
+        return 0;
+}
+
+void yakvm_destroy_hosts(void)
+{
+        struct host *host;
+        int cpu;
+
+        for_each_possible_cpu(cpu) {
+                host = per_cpu_ptr(&yakvm_host, cpu);
+                free_page((unsigned long)host->hsave);
+                free_page((unsigned long)host->vmcb);
+                host->hsave = NULL;
+                host->vmcb = NULL;
+        }
+}
+
+/* @bit area of the *vmcb* is modified and must be reloaded by *vmrun* */
+static inline void yakvm_vmcb_mark_dirty(struct vmcb *vmcb, int bit)
+{
+        vmcb->control.clean &= ~BIT(bit);
+}
+
+static inline void yakvm_vmcb_set_intercept(struct vmcb *vmcb,
+                                            uint32_t bit)
+{
+        assert(bit < 32 * MAX_INTERCEPT);
+        __set_bit(bit, (unsigned long *)&vmcb->control.intercepts);
+        yakvm_vmcb_mark_dirty(vmcb, VMCB_INTERCEPTS);
+}
+
+static inline void yakvm_vmcb_clr_intercept(struct vmcb *vmcb,
+                                            uint32_t bit)
+{
+        assert(bit < 32 * MAX_INTERCEPT);
+        __clear_bit(bit, (unsigned long *)&vmcb->control.intercepts);
+        yakvm_vmcb_mark_dirty(vmcb, VMCB_INTERCEPTS);
+}
+
+static inline void yakvm_vmcb_set_exception_intercept(struct vmcb *vmcb,
+                                            uint32_t bit)
+{
+        yakvm_vmcb_set_intercept(vmcb, INTERCEPT_EXCEPTION_OFFSET + bit);
+}
+
+static inline void yakvm_vmcb_clr_exception_intercept(struct vmcb *vmcb,
+                                            uint32_t bit)
+{
+        yakvm_vmcb_clr_intercept(vmcb, INTERCEPT_EXCEPTION_OFFSET + bit);
+}
 
 static int yakvm_vcpu_release(struct inode *inode, struct file *filp)
 {
@@ -28,6 +170,56 @@ static int yakvm_vcpu_release(struct inode *inode, struct file *filp)
         return 0;
 }
 
+/* save the vcpu registers into @regs */
+static void yakvm_vcpu_save_regs(struct vcpu *vcpu, struct registers *regs)
+{
+        regs->rax = vcpu->gctx.vmcb->save.rax;
+        regs->rbx = vcpu->gctx.rbx;
+        regs->rcx = vcpu->gctx.rcx;
+        regs->rdx = vcpu->gctx.rdx;
+        regs->rdi = vcpu->gctx.rdi;
+        regs->rsi = vcpu->gctx.rsi;
+        regs->rbp = vcpu->gctx.rbp;
+        regs->rsp = vcpu->gctx.vmcb->save.rsp;
+        regs->r8 = vcpu->gctx.r8;
+        regs->r9 = vcpu->gctx.r9;
+        regs->r10 = vcpu->gctx.r10;
+        regs->r11 = vcpu->gctx.r11;
+        regs->r12 = vcpu->gctx.r12;
+        regs->r13 = vcpu->gctx.r13;
+        regs->r14 = vcpu->gctx.r14;
+        regs->r15 = vcpu->gctx.r15;
+        regs->rip = vcpu->gctx.vmcb->save.rip;
+        regs->cs = vcpu->gctx.vmcb->save.cs.base;
+        regs->ss = vcpu->gctx.vmcb->save.ss.base;
+}
+
+/* load the vcpu registers from @regs */
+static void yakvm_vcpu_load_regs(struct vcpu *vcpu,
+                                 const struct registers *regs)
+{
+        vcpu->gctx.vmcb->save.rax = regs->rax;
+        vcpu->gctx.rbx = regs->rbx;
+        vcpu->gctx.rcx = regs->rcx;
+        vcpu->gctx.rdx = regs->rdx;
+        vcpu->gctx.rdi = regs->rdi;
+        vcpu->gctx.rsi = regs->rsi;
+        vcpu->gctx.rbp = regs->rbp;
+        vcpu->gctx.vmcb->save.rsp = regs->rsp;
+        vcpu->gctx.r8 = regs->r8;
+        vcpu->gctx.r9 = regs->r9;
+        vcpu->gctx.r10 = regs->r10;
+        vcpu->gctx.r11 = regs->r11;
+        vcpu->gctx.r12 = regs->r12;
+        vcpu->gctx.r13 = regs->r13;
+        vcpu->gctx.r14 = regs->r14;
+        vcpu->gctx.r15 = regs->r15;
+        vcpu->gctx.vmcb->save.rip = regs->rip;
+        vcpu->gctx.vmcb->save.cs.base = regs->cs;
+        vcpu->gctx.vmcb->save.ss.base = regs->ss;
+        yakvm_vmcb_mark_dirty(vcpu->gctx.vmcb, VMCB_SEG);
+}
+
 /*
  * share error information from vcpu to userspace, so that
  * virtual machine error can be handled in userspace.
@@ -43,33 +235,319 @@ static void yakvm_vcpu_share_err_to_user(struct vcpu *vcpu)
         state->exit_info_2 = control->exit_info_2;
         state->cs = save->cs.base;
         state->rip = save->rip;
+        yakvm_vcpu_save_regs(vcpu, &state->regs);
+}
+
+/*
+ * sync the state modified by userspace into the vcpu
+ * before re-entering the guest.
+ */
+static void yakvm_vcpu_sync_state_from_user(struct vcpu *vcpu)
+{
+        struct state *state = vcpu->state;
+
+        if (READ_ONCE(state->dirty) & YAKVM_DIRTY_REGS) {
+                yakvm_vcpu_load_regs(vcpu, &state->regs);
+                WRITE_ONCE(state->dirty, 0);
+        }
+
+        /*
+         * complete the PIO/MMIO read with the value from userspace,
+         * whose size is the decoded one, as only *io.data* is taken
+         * from the shared page.
+         */
+        if (vcpu->io_pending && vcpu->io_direction == YAKVM_IO_IN) {
+                uint64_t mask = GENMASK_ULL(vcpu->io_size * 8 - 1, 0);
+                struct vmcb_save_area *save = &vcpu->gctx.vmcb->save;
+
+                save->rax = (save->rax & ~mask) | (state->io.data & mask);
+                vcpu->io_pending = false;
+        }
+}
+
+/*
+ * force the vcpu running in guest on another physical cpu to exit
+ * with the physical *INTR*, so it notices the new pending work.
+ */
+static void yakvm_vcpu_kick(struct vcpu *vcpu)
+{
+        int cpu, me;
+
+        /* pairs with the smp_mb() in yakvm_vcpu_enter_guest() */
+        smp_mb__after_atomic();
+        if (!READ_ONCE(vcpu->in_guest)) {
+                return;
+        }
+
+        me = get_cpu();
+        cpu = READ_ONCE(vcpu->cpu);
+        if (cpu != me && cpu_online(cpu)) {
+                smp_send_reschedule(cpu);
+        }
+        put_cpu();
+}
+
+/* queue the external interrupt @vector for the vcpu */
+void yakvm_vcpu_interrupt(struct vcpu *vcpu, uint8_t vector)
+{
+        set_bit(vector, vcpu->irqs);
+        yakvm_vcpu_kick(vcpu);
+
+        /* wq_has_sleeper() orders the bit against the halted vcpu */
+        if (wq_has_sleeper(&vcpu->wq)) {
+                wake_up_interruptible(&vcpu->wq);
+        }
+}
+
+/*
+ * make the @req served by the vcpu on the next *vmrun*, and wait
+ * until the vcpu running in guest exits, so the request takes effect
+ * once this returns.
+ */
+static void yakvm_vcpu_make_request(struct vcpu *vcpu, int req)
+{
+        set_bit(req, &vcpu->requests);
+        yakvm_vcpu_kick(vcpu);
+
+        while (READ_ONCE(vcpu->in_guest) && test_bit(req, &vcpu->requests)) {
+                cpu_relax();
+        }
+}
+
+/* no stale translation of the NPT is used after this returns */
+void yakvm_vcpu_flush_tlb(struct vcpu *vcpu)
+{
+        yakvm_vcpu_make_request(vcpu, YAKVM_REQ_TLB_FLUSH);
+}
+
+/* no port is accessed through the old *iopm* after this returns */
+void yakvm_vcpu_reload_iopm(struct vcpu *vcpu)
+{
+        yakvm_vcpu_make_request(vcpu, YAKVM_REQ_IOPM_RELOAD);
+}
+
+/* whether the halted vcpu can take the pending interrupt */
+static bool yakvm_vcpu_runnable(struct vcpu *vcpu)
+{
+        return (vcpu->gctx.vmcb->save.rflags & X86_EFLAGS_IF) &&
+               find_first_bit(vcpu->irqs, YAKVM_NR_VECTORS) !=
+               YAKVM_NR_VECTORS;
+}
+
+/*
+ * block the halted vcpu until it can take the interrupt, which
+ * polls for the interrupt within the *halt_poll_ns* window first to
+ * avoid the scheduler wakeup latency, and then sleeps.
+ *
+ * The vcpu stays halted when it returns for the pending signals or
+ * rescheduling, and blocks again on the next entry.
+ */
+static void yakvm_vcpu_block(struct vcpu *vcpu)
+{
+        ktime_t start = ktime_get(), stop;
+        uint64_t block_ns;
+
+        stop = ktime_add_ns(start, vcpu->halt_poll_ns);
+        while (!yakvm_vcpu_runnable(vcpu)) {
+                if (signal_pending(current) || need_resched()) {
+                        return;
+                }
+
+                if (ktime_after(ktime_get(), stop)) {
+                        wait_event_interruptible(vcpu->wq,
+                                                 yakvm_vcpu_runnable(vcpu));
+                        break;
+                }
+
+                cpu_relax();
+        }
+
+        if (!yakvm_vcpu_runnable(vcpu)) {
+                return;
+        }
+        vcpu->halted = false;
+
+        /*
+         * grow the window if the interrupt arrives shortly after it,
+         * and shrink the window if the vcpu sleeps for too long that
+         * polling only wastes the cpu.
+         */
+        block_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+        if (block_ns > halt_poll_ns) {
+                vcpu->halt_poll_ns /= 2;
+                if (vcpu->halt_poll_ns < YAKVM_HALT_POLL_NS_START) {
+                        vcpu->halt_poll_ns = 0;
+                }
+        } else if (block_ns > vcpu->halt_poll_ns) {
+                vcpu->halt_poll_ns = vcpu->halt_poll_ns ?
+                                     vcpu->halt_poll_ns * 2 :
+                                     YAKVM_HALT_POLL_NS_START;
+                vcpu->halt_poll_ns = min(vcpu->halt_poll_ns, halt_poll_ns);
+        }
+}
+
+/*
+ * account the cputime between yakvm_guest_timing_enter() and
+ * yakvm_guest_timing_exit() as the guest time instead of the system
+ * time, which mirrors guest_timing_enter_irqoff() of the kvm.
+ */
+static __always_inline void yakvm_guest_timing_enter(void)
+{
+        vtime_account_guest_enter();
+}
+
+static __always_inline void yakvm_guest_timing_exit(void)
+{
+        vtime_account_guest_exit();
+}
+
+/*
+ * tell the context tracking and RCU that the cpu runs the guest,
+ * which is an extended quiescent state like the userspace, so
+ * the nohz_full cpu is not interrupted for the host.
+ */
+static __always_inline void yakvm_guest_context_enter(void)
+{
+        if (!context_tracking_guest_enter()) {
+                rcu_virt_note_context_switch();
+        }
+}
+
+static __always_inline void yakvm_guest_context_exit(void)
+{
+        context_tracking_guest_exit();
+}
+
+/*
+ * inject the pending interrupt through *event_inj* if the guest can
+ * take it, otherwise request a *VINTR* exit for the interrupt window
+ * with a virtual interrupt according to "15.21" on page 532 at
+ * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+ */
+static void yakvm_vcpu_inject_interrupt(struct vcpu *vcpu)
+{
+        struct vmcb_control_area *control = &vcpu->gctx.vmcb->control;
+        struct vmcb_save_area *save = &vcpu->gctx.vmcb->save;
+        unsigned long vector;
+
+        /*
+         * The event being delivered when the *vmexit* happened should
+         * be re-injected according to "15.7.2" on page 510 at
+         * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+         */
+        if (control->exit_int_info & SVM_EXITINTINFO_VALID) {
+                control->event_inj = control->exit_int_info;
+                control->event_inj_err = control->exit_int_info_err;
+                control->exit_int_info = 0;
+                return;
+        }
+
+        vector = find_first_bit(vcpu->irqs, YAKVM_NR_VECTORS);
+        if (vector == YAKVM_NR_VECTORS) {
+                return;
+        }
+
+        if ((save->rflags & X86_EFLAGS_IF) &&
+            !(control->int_state & SVM_INTERRUPT_SHADOW_MASK)) {
+                clear_bit(vector, vcpu->irqs);
+                control->event_inj = vector | SVM_EVTINJ_TYPE_INTR |
+                                     SVM_EVTINJ_VALID;
+        } else if (!(control->int_ctl & V_IRQ_MASK)) {
+                control->int_ctl |= V_IRQ_MASK | V_INTR_PRIO_MASK |
+                                    V_IGN_TPR_MASK;
+                yakvm_vmcb_mark_dirty(vcpu->gctx.vmcb, VMCB_INTR);
+                yakvm_vmcb_set_intercept(vcpu->gctx.vmcb, INTERCEPT_VINTR);
+        }
+}
+
+/*
+ * the guest opens the interrupt window, so the pending interrupt
+ * can be injected on next *vmrun*.
+ */
+static int yakvm_vcpu_handle_vintr(struct vcpu *vcpu)
+{
+        struct vmcb *vmcb = vcpu->gctx.vmcb;
+
+        vmcb->control.int_ctl &= ~V_IRQ_MASK;
+        yakvm_vmcb_mark_dirty(vmcb, VMCB_INTR);
+        yakvm_vmcb_clr_intercept(vmcb, INTERCEPT_VINTR);
+        return 1;
+}
+
+/*
+ * assign a new ASID from the physical cpu, so the vcpu never
+ * sees the TLB entries tagged by other vcpus.
+ */
+static void yakvm_vcpu_new_asid(struct vcpu *vcpu, struct host *host)
+{
+        struct vmcb *vmcb = vcpu->gctx.vmcb;
+
+        if (host->next_asid > host->max_asid) {
+                ++host->asid_generation;
+                host->next_asid = 1;
+                vmcb->control.tlb_ctl = TLB_CONTROL_FLUSH_ALL_ASID;
+        }
+
+        vcpu->asid_generation = host->asid_generation;
+        vmcb->control.asid = host->next_asid++;
+        yakvm_vmcb_mark_dirty(vmcb, VMCB_ASID);
 }
 
 /*
- * run virtual machine with *vmrun* according to
+ * enter the guest with *vmrun* once according to
  * "15.5" on page 81 at
  * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
  */
-static int yakvm_vcpu_run(struct vcpu *vcpu)
+static void yakvm_vcpu_enter_guest(struct vcpu *vcpu)
 {
+        uint64_t entry_tsc, exit_tsc;
+        uint32_t exit_code;
+        struct host *host;
 
         /*
          * This ensures that the vcpu is binded on the physical cpu
          * instead of being scheduled to other physical cpus.
+         *
+         * Note that physical cpu *VM_HSAVE_PA* MSR has been set to
+         * the per physical cpu *hsave* in yakvm_cpu_svm_enable().
          */
         preempt_disable();
+        host = this_cpu_ptr(&yakvm_host);
+        vcpu->hctx.vmcb = host->vmcb;
 
         /*
-         * physical cpu *VM_HSAVE_PA* MSR holds the physical address
-         * of a block of memory where *vmrun* save host state and from
-         * which *vmexit* reloads host state according to "15.30.4" on
-         * page 585 at
-         * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf.
-         *
-         * Note that this setting is pcpu specific, so is should be
-         * setted after the vcpu is binded to the pcpu.
+         * The processor caches the *vmcb* per physical cpu, so all
+         * areas are dirty when the *vmcb* was not the last one run on
+         * this physical cpu, e.g. the vcpu migrates.
          */
-        wrmsrl(MSR_VM_HSAVE_PA, virt_to_phys(vcpu->hsave));
+        if (host->current_vmcb != vcpu->gctx.vmcb) {
+                vcpu->gctx.vmcb->control.clean = 0;
+                host->current_vmcb = vcpu->gctx.vmcb;
+        }
+
+        /*
+         * The ASID is only valid on the physical cpu that assigned it
+         * and within its generation.
+         */
+        if (vcpu->cpu != smp_processor_id()) {
+                vcpu->asid_generation = 0;
+                vcpu->cpu = smp_processor_id();
+        }
+        if (vcpu->asid_generation != host->asid_generation) {
+                yakvm_vcpu_new_asid(vcpu, host);
+        }
+
+        /* tracepoints are not safe to run with *gif* cleared */
+        trace_yakvm_entry(vcpu);
+
+        /*
+         * The cputime is charged to the guest from here, and the
+         * physical interrupts are held until the guest time ends,
+         * except inside *vmrun* where *_yakvm_vcpu_run* sets
+         * *EFLAGS.IF* so they force an *INTR* exit.
+         */
+        local_irq_disable();
+        yakvm_guest_timing_enter();
 
         /*
          * It is assumed that kernel cleared *gif* some time before
@@ -77,44 +555,493 @@ static int yakvm_vcpu_run(struct vcpu *vcpu)
          * state switch according to "15.5.1" on page 502 at
          * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf.
          */
+        WRITE_ONCE(vcpu->in_guest, true);
+        smp_mb();
         asm volatile (
                 "clgi\n\t"
         );
 
+        /*
+         * The interrupt queued after this point kicks the vcpu, and
+         * the kick stays pending with *gif* cleared, so it forces a
+         * *vmexit* right after the *vmrun*.
+         */
+        yakvm_vcpu_inject_interrupt(vcpu);
+
+        /* the new ASID has nothing to flush */
+        if (test_and_clear_bit(YAKVM_REQ_TLB_FLUSH, &vcpu->requests) &&
+            vcpu->gctx.vmcb->control.tlb_ctl == TLB_CONTROL_DO_NOTHING) {
+                vcpu->gctx.vmcb->control.tlb_ctl =
+                        boot_cpu_has(X86_FEATURE_FLUSHBYASID) ?
+                        TLB_CONTROL_FLUSH_ASID : TLB_CONTROL_FLUSH_ALL_ASID;
+        }
+
+        /* the vm replaced its *iopm* in yakvm_iopm_intercept() */
+        if (test_and_clear_bit(YAKVM_REQ_IOPM_RELOAD, &vcpu->requests)) {
+                vcpu->gctx.vmcb->control.iopm_base_pa =
+                        virt_to_phys(READ_ONCE(vcpu->vm->iopm)->bitmap);
+                yakvm_vmcb_mark_dirty(vcpu->gctx.vmcb, VMCB_PERM_MAP);
+        }
+
         /*
          * Considering that *vmrun* and *vmexit* only saves part or none
          * of host state, kernel should also use *vmsave* and *vmload*
          * to restore the totaly host state according to "15.5.1"
          * on page 501 at
          * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+         *
+         * The state saved by *vmsave* does not change until the thread
+         * is scheduled out or returns to the userspace, so *vmsave* is
+         * skipped for the back to back *vmrun*. However, the guest
+         * state is loaded by *vmload* before *vmrun*, so the host state
+         * still needs to be reloaded after each *vmexit*.
          */
-        asm volatile (
-                "vmsave %0\n\t"
-                :
-                :"a"(virt_to_phys(vcpu->hctx.vmcb))
-                :"memory"
-        );
+        if (!host->saved) {
+                asm volatile (
+                        "vmsave %0\n\t"
+                        :
+                        :"a"(virt_to_phys(host->vmcb))
+                        :"memory"
+                );
+                host->saved = true;
+        }
 
         /* enter guest */
+        yakvm_guest_context_enter();
+        entry_tsc = rdtsc();
         _yakvm_vcpu_run(&vcpu->gctx, &vcpu->hctx, virt_to_phys(vcpu->gctx.vmcb));
 
         asm volatile (
                 "vmload %0\n\t"
                 :
-                :"a"(virt_to_phys(vcpu->hctx.vmcb))
+                :"a"(virt_to_phys(host->vmcb))
                 :"cc"
         );
+        exit_tsc = rdtsc();
+        yakvm_guest_context_exit();
+
+        vcpu->gctx.vmcb->control.tlb_ctl = TLB_CONTROL_DO_NOTHING;
+
+        /* the areas are cached until the kernel modifies them */
+        if (boot_cpu_has(X86_FEATURE_VMCBCLEAN)) {
+                vcpu->gctx.vmcb->control.clean = VMCB_ALL_CLEAN_MASK;
+        }
 
         asm volatile (
                 "stgi\n\t"
         );
+        WRITE_ONCE(vcpu->in_guest, false);
+
+        /*
+         * the host cycles from the last *vmexit* to this *vmrun* are
+         * the latency to handle the exit inside the kernel.
+         */
+        vcpu->stats->guest_cycles += exit_tsc - entry_tsc;
+        if (vcpu->exit_tsc) {
+                vcpu->stats->host_cycles += entry_tsc - vcpu->exit_tsc;
+                yakvm_stats_hist_log2(vcpu->stats->exit_latency,
+                                      entry_tsc - vcpu->exit_tsc);
+        }
+        vcpu->exit_tsc = exit_tsc;
+
+        exit_code = vcpu->gctx.vmcb->control.exit_code;
+        if (exit_code < YAKVM_STATS_NR_EXITS) {
+                vcpu->stats->exits[exit_code]++;
+        }
 
+        /*
+         * The tick interrupt which triggered the *vmexit* is handled
+         * within the window, so the tick based accounting charges it
+         * to the guest time as the guest was interrupted.
+         */
+        local_irq_enable();
+        local_irq_disable();
+        yakvm_guest_timing_exit();
+        local_irq_enable();
+
+        trace_yakvm_exit(vcpu);
         preempt_enable();
+}
+
+/*
+ * the saved host state belongs to the thread, so it is invalid
+ * once the thread is scheduled out.
+ */
+static void yakvm_vcpu_sched_in(struct preempt_notifier *pn, int cpu)
+{
+}
+
+static void yakvm_vcpu_sched_out(struct preempt_notifier *pn,
+                                 struct task_struct *next)
+{
+        this_cpu_write(yakvm_host.saved, false);
+}
+
+static struct preempt_ops yakvm_vcpu_preempt_ops = {
+        .sched_in = yakvm_vcpu_sched_in,
+        .sched_out = yakvm_vcpu_sched_out,
+};
+
+/* the thread starts running the vcpu */
+static void yakvm_vcpu_load(struct vcpu *vcpu)
+{
+        preempt_disable();
+        preempt_notifier_register(&vcpu->pn);
+        preempt_enable();
+}
+
+/*
+ * the thread stops running the vcpu and returns to the userspace,
+ * where the *fs*, *gs* and so on in the host state may be changed.
+ */
+static void yakvm_vcpu_put(struct vcpu *vcpu)
+{
+        preempt_disable();
+        preempt_notifier_unregister(&vcpu->pn);
+        this_cpu_write(yakvm_host.saved, false);
+        preempt_enable();
+}
+
+/*
+ * try to handle the decoded PIO/MMIO inside the kernel, the rip
+ * has been updated to the next instruction, so the guest can be
+ * resumed directly.
+ */
+static int yakvm_vcpu_handle_io(struct vcpu *vcpu)
+{
+        struct io *io = &vcpu->state->io;
+
+        if (vcpu->io_direction == YAKVM_IO_OUT &&
+            yakvm_io_write(vcpu->vm, io)) {
+                return 1;
+        }
+
+        return 0;
+}
+
+/*
+ * decode the PIO into *state.io* for the userspace. The rip of the
+ * instruction following the IN/OUT is saved in EXITINFO2, so the
+ * guest is resumed there after the emulation according to
+ * "15.10.2" on page 516 at
+ * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+ */
+static int yakvm_vcpu_handle_ioio(struct vcpu *vcpu)
+{
+        struct vmcb *vmcb = vcpu->gctx.vmcb;
+        uint32_t info = vmcb->control.exit_info_1;
+        struct io *io = &vcpu->state->io;
+
+        vcpu->io_size = svm_ioio_size(info);
+        io->type = YAKVM_IO_PIO;
+        io->size = vcpu->io_size;
+        io->address = svm_ioio_port(info);
+        if (svm_ioio_type(info) == SVM_IOIO_TYPE_IN) {
+                vcpu->io_direction = YAKVM_IO_IN;
+                vcpu->io_pending = true;
+        } else {
+                vcpu->io_direction = YAKVM_IO_OUT;
+                io->data = vmcb->save.rax &
+                           GENMASK_ULL(vcpu->io_size * 8 - 1, 0);
+        }
+        io->direction = vcpu->io_direction;
+
+        vmcb->save.rip = vmcb->control.exit_info_2;
+        return yakvm_vcpu_handle_io(vcpu);
+}
+
+/*
+ * Decode the mmio into *state.io* for the userspace. For simplicity,
+ * we only support the *movb (edx), al* and *movb al, (edx)*
+ * instructions, where %edx holds the mmio address and
+ * %al holds the value.
+ */
+static int yakvm_vcpu_handle_mmio(struct vcpu *vcpu)
+{
+        struct vmcb *vmcb = vcpu->gctx.vmcb;
+        struct io *io = &vcpu->state->io;
+        uint8_t insn[3];
+        int r;
+
+        r = yakvm_vmm_read(vcpu->vm->vmm, vmcb->save.cs.base + vmcb->save.rip,
+                           insn, sizeof(insn));
+        if (r) {
+                log(LOG_ERR, "yakvm_vmm_read() failed with error code %d", r);
+                return r;
+        }
+
+        /*
+         * The address-size override prefix can override the
+         * default 16-bit addresses to effective 32-bit addresses
+         * according to "1.2.3" on page 9 at
+         * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24594.pdf
+         *
+         * Opcode 0x88 represents *mov mem8, reg8*, which is mmio out
+         * instruction, and Opcode 0x8a represents *mov reg8, mem8*,
+         * which is mmio in instruction, according to "MOV" on page 234 at
+         * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24594.pdf
+         *
+         * Operands should be in ModRM byte format, meaning
+         * %edx contains the mmio address an %al holds the
+         * vlaue described in "1.4.3" on page 21 at
+         * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24594.pdf
+         */
+        if (insn[0] != 0x67 || insn[2] != 0x02 ||
+            (insn[1] != 0x88 && insn[1] != 0x8a)) {
+                log(LOG_ERR, "unsupported mmio instruction "
+                    "%02x %02x %02x", insn[0], insn[1], insn[2]);
+                return -EOPNOTSUPP;
+        }
+
+        vcpu->io_size = 1;
+        io->type = YAKVM_IO_MMIO;
+        io->size = vcpu->io_size;
+        io->address = vmcb->control.exit_info_2;
+        if (insn[1] == 0x8a) {
+                vcpu->io_direction = YAKVM_IO_IN;
+                vcpu->io_pending = true;
+        } else {
+                vcpu->io_direction = YAKVM_IO_OUT;
+                io->data = vmcb->save.rax & 0xff;
+        }
+        io->direction = vcpu->io_direction;
+
+        /* update the rip to the next instruction address */
+        vmcb->save.rip += sizeof(insn);
+        return yakvm_vcpu_handle_io(vcpu);
+}
+
+/*
+ * populate the nested page table for the guest ram inside the kernel,
+ * only the mmio should be handled by the userspace. The faulting gpa
+ * is saved in EXITINFO2 according to "15.25.6" on page 551 at
+ * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+ */
+static int yakvm_vcpu_handle_npf(struct vcpu *vcpu)
+{
+        unsigned long info = vcpu->gctx.vmcb->control.exit_info_1;
+        unsigned long gpa = vcpu->gctx.vmcb->control.exit_info_2;
+        struct vmm *vmm = vcpu->vm->vmm;
+        struct page *page;
+
+        if (!yakvm_vmm_is_ram(vmm, gpa)) {
+                return yakvm_vcpu_handle_mmio(vcpu);
+        }
+
+        /* the write to the write-protected page of the dirty logging */
+        if ((info & YAKVM_NPF_INFO1_P) && (info & YAKVM_NPF_INFO1_RW) &&
+            yakvm_vmm_log_dirty(vmm, gpa)) {
+                return 1;
+        }
+
+        page = yakvm_vmm_npt_create(vmm, gpa, false);
+        if (IS_ERR(page)) {
+                log(LOG_ERR, "yakvm_vmm_npt_create() "
+                    "failed with error code %ld", PTR_ERR(page));
+                return PTR_ERR(page);
+        }
+
+        return 1;
+}
+
+/*
+ * The *HLT* intercept is checked before the instruction executes,
+ * so skip the one-byte *HLT* and block the vcpu in the kernel until
+ * the interrupt arrives if enabled by *YAKVM_HALT*, otherwise exit
+ * to the userspace as before.
+ */
+static int yakvm_vcpu_handle_hlt(struct vcpu *vcpu)
+{
+        if (!vcpu->halt) {
+                return 0;
+        }
+
+        vcpu->gctx.vmcb->save.rip += 1;
+        vcpu->halted = true;
+        return 1;
+}
+
+/*
+ * record the exit into the trace ring, return false if
+ * the ring is full.
+ */
+static bool yakvm_vcpu_trace(struct vcpu *vcpu)
+{
+        struct trace_ring *ring = vcpu->trace_ring;
+        struct vmcb *vmcb = vcpu->gctx.vmcb;
+        struct trace_entry *entry;
+        uint32_t last = vcpu->trace_last;
+        unsigned long gpa;
+
+        if ((last + 1) % YAKVM_TRACE_RING_MAX == READ_ONCE(ring->first)) {
+                return false;
+        }
+
+        entry = &ring->entries[last];
+        entry->tsc = rdtsc();
+        entry->cs = vmcb->save.cs.base;
+        entry->rip = vmcb->save.rip;
+        entry->exit_code = vmcb->control.exit_code;
+
+        /* only fetch the opcode bytes within the page of cs:rip */
+        gpa = entry->cs + entry->rip;
+        entry->insn_len = min(sizeof(entry->insn),
+                              PAGE_SIZE - (gpa & ~PAGE_MASK));
+        if (yakvm_vmm_read(vcpu->vm->vmm, gpa, entry->insn,
+                           entry->insn_len)) {
+                entry->insn_len = 0;
+        }
+
+        /* publish the entry before the userspace sees the new *last* */
+        smp_wmb();
+        vcpu->trace_last = (last + 1) % YAKVM_TRACE_RING_MAX;
+        WRITE_ONCE(ring->last, vcpu->trace_last);
+        return true;
+}
+
+/*
+ * Enable the *X86_EFLAGS_TF* to enable single-step mode for
+ * tracing the guest code according to "13.1.4" on page 407 at
+ * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+ */
+static int yakvm_vcpu_set_trace(struct vcpu *vcpu, bool enable)
+{
+        struct vmcb *vmcb = vcpu->gctx.vmcb;
+
+        if (enable && !vcpu->trace_ring) {
+                vcpu->trace_ring = vmalloc_user(YAKVM_TRACE_RING_SIZE);
+                if (!vcpu->trace_ring) {
+                        log(LOG_ERR, "vmalloc_user() failed");
+                        return -ENOMEM;
+                }
+        }
+
+        vcpu->trace = enable;
+        if (enable) {
+                vmcb->save.rflags |= X86_EFLAGS_TF;
+                yakvm_vmcb_set_exception_intercept(vmcb, DB_VECTOR);
+        } else {
+                vmcb->save.rflags &= ~X86_EFLAGS_TF;
+                yakvm_vmcb_clr_exception_intercept(vmcb, DB_VECTOR);
+        }
 
-        yakvm_vcpu_share_err_to_user(vcpu);
         return 0;
 }
 
+/*
+ * handle the *vmexit* inside the kernel when possible, so that
+ * the vcpu can re-enter the guest without a round trip to the
+ * userspace.
+ *
+ * Return 1 if the exit has been handled and the guest can be
+ * resumed, 0 if the exit should be handled by the userspace,
+ * or a negative error code.
+ */
+static int yakvm_vcpu_handle_exit(struct vcpu *vcpu)
+{
+        switch (vcpu->gctx.vmcb->control.exit_code) {
+                /* the single-step has been recorded in the trace ring */
+                case SVM_EXIT_EXCP_BASE + DB_VECTOR:
+                        return 1;
+
+                case SVM_EXIT_NPF:
+                        return yakvm_vcpu_handle_npf(vcpu);
+
+                case SVM_EXIT_IOIO:
+                        return yakvm_vcpu_handle_ioio(vcpu);
+
+                case SVM_EXIT_VINTR:
+                        return yakvm_vcpu_handle_vintr(vcpu);
+
+                /* the host has handled the interrupt after *stgi* */
+                case SVM_EXIT_INTR:
+                        return 1;
+
+                case SVM_EXIT_HLT:
+                        return yakvm_vcpu_handle_hlt(vcpu);
+
+                default:
+                        return 0;
+        }
+}
+
+/*
+ * run virtual machine until an exit which can not be handled
+ * inside the kernel, or the thread should go back to the
+ * userspace for pending signals or rescheduling.
+ */
+static int yakvm_vcpu_run_loop(struct vcpu *vcpu)
+{
+        int r;
+
+        yakvm_vcpu_sync_state_from_user(vcpu);
+
+        for (;;) {
+                /*
+                 * The exit has been handled, so only return to the
+                 * userspace for the pending signals, and give up the
+                 * cpu inside the kernel for rescheduling.
+                 */
+                if (signal_pending(current)) {
+                        yakvm_vcpu_share_err_to_user(vcpu);
+                        vcpu->state->exit_code = YAKVM_EXIT_INTR;
+                        return -EINTR;
+                }
+                cond_resched();
+
+                if (vcpu->halted) {
+                        yakvm_vcpu_block(vcpu);
+                        /* sleeping is not the latency of the exit */
+                        vcpu->exit_tsc = 0;
+                        continue;
+                }
+
+                yakvm_vcpu_enter_guest(vcpu);
+
+                /*
+                 * When the trace ring is full, the single-step *#DB* is
+                 * reported to the userspace as before, while other exits
+                 * are left unhandled and re-triggered after the userspace
+                 * drains the ring.
+                 */
+                if (vcpu->trace && !yakvm_vcpu_trace(vcpu)) {
+                        yakvm_vcpu_share_err_to_user(vcpu);
+                        if (vcpu->gctx.vmcb->control.exit_code !=
+                            SVM_EXIT_EXCP_BASE + DB_VECTOR) {
+                                vcpu->state->exit_code = YAKVM_EXIT_INTR;
+                        }
+                        return 0;
+                }
+
+                r = yakvm_vcpu_handle_exit(vcpu);
+                if (r < 0) {
+                        log(LOG_ERR, "yakvm_vcpu_handle_exit() failed "
+                            "with error code %d", r);
+                        return r;
+                }
+
+                if (!r) {
+                        yakvm_vcpu_share_err_to_user(vcpu);
+                        return 0;
+                }
+        }
+}
+
+static int yakvm_vcpu_run(struct vcpu *vcpu)
+{
+        int r;
+
+        yakvm_vcpu_load(vcpu);
+        r = yakvm_vcpu_run_loop(vcpu);
+        yakvm_vcpu_put(vcpu);
+
+        /* the userspace handling is not counted as the exit latency */
+        vcpu->exit_tsc = 0;
+        vcpu->stats->userspace_exits++;
+
+        return r;
+}
+
 /* copy vcpu registers state to userspace */
 static int yakvm_vcpu_get_regs(struct vcpu *vcpu,
                                void * __user dest)
@@ -122,25 +1049,7 @@ static int yakvm_vcpu_get_regs(struct vcpu *vcpu,
         struct registers regs;
         int r;
 
-        regs.rax = vcpu->gctx.vmcb->save.rax;
-        regs.rbx = vcpu->gctx.rbx;
-        regs.rcx = vcpu->gctx.rcx;
-        regs.rdx = vcpu->gctx.rdx;
-        regs.rdi = vcpu->gctx.rdi;
-        regs.rsi = vcpu->gctx.rsi;
-        regs.rbp = vcpu->gctx.rbp;
-        regs.rsp = vcpu->gctx.vmcb->save.rsp;
-        regs.r8 = vcpu->gctx.r8;
-        regs.r9 = vcpu->gctx.r9;
-        regs.r10 = vcpu->gctx.r10;
-        regs.r11 = vcpu->gctx.r11;
-        regs.r12 = vcpu->gctx.r12;
-        regs.r13 = vcpu->gctx.r13;
-        regs.r14 = vcpu->gctx.r14;
-        regs.r15 = vcpu->gctx.r15;
-        regs.rip = vcpu->gctx.vmcb->save.rip;
-        regs.cs = vcpu->gctx.vmcb->save.cs.base;
-        regs.ss = vcpu->gctx.vmcb->save.ss.base;
+        yakvm_vcpu_save_regs(vcpu, &regs);
 
         r = copy_to_user(dest, &regs, sizeof(regs));
         if (r) {
@@ -164,25 +1073,7 @@ static int yakvm_vcpu_set_regs(struct vcpu *vcpu,
                 return -EFAULT;
         }
 
-        vcpu->gctx.vmcb->save.rax = regs.rax;
-        vcpu->gctx.rbx = regs.rbx;
-        vcpu->gctx.rcx = regs.rcx;
-        vcpu->gctx.rdx = regs.rdx;
-        vcpu->gctx.rdi = regs.rdi;
-        vcpu->gctx.rsi = regs.rsi;
-        vcpu->gctx.rbp = regs.rbp;
-        vcpu->gctx.vmcb->save.rsp = regs.rsp;
-        vcpu->gctx.r8 = regs.r8;
-        vcpu->gctx.r9 = regs.r9;
-        vcpu->gctx.r10 = regs.r10;
-        vcpu->gctx.r11 = regs.r11;
-        vcpu->gctx.r12 = regs.r12;
-        vcpu->gctx.r13 = regs.r13;
-        vcpu->gctx.r14 = regs.r14;
-        vcpu->gctx.r15 = regs.r15;
-        vcpu->gctx.vmcb->save.rip = regs.rip;
-        vcpu->gctx.vmcb->save.cs.base = regs.cs;
-        vcpu->gctx.vmcb->save.ss.base = regs.ss;
+        yakvm_vcpu_load_regs(vcpu, &regs);
 
         return 0;
 }
@@ -193,6 +1084,18 @@ static long yakvm_vcpu_ioctl(struct file *filp, unsigned int ioctl,
         struct vcpu *vcpu = filp->private_data;
         int r = 0;
 
+        /*
+         * queuing the interrupt is atomic, so it can be issued by
+         * other threads while the vcpu is running.
+         */
+        if (ioctl == YAKVM_INTERRUPT) {
+                if (arg >= YAKVM_NR_VECTORS) {
+                        return -EINVAL;
+                }
+                yakvm_vcpu_interrupt(vcpu, arg);
+                return 0;
+        }
+
         if (mutex_lock_killable(&vcpu->lock))
                 return -EINTR;
 
@@ -209,6 +1112,18 @@ static long yakvm_vcpu_ioctl(struct file *filp, unsigned int ioctl,
                         r = yakvm_vcpu_set_regs(vcpu, (void *)arg);
                         break;
 
+                case YAKVM_TRACE:
+                        r = yakvm_vcpu_set_trace(vcpu, arg);
+                        break;
+
+                case YAKVM_HALT:
+                        vcpu->halt = arg;
+                        break;
+
+                case YAKVM_GET_STATS_FD:
+                        r = yakvm_stats_getfd(vcpu->vm, vcpu->stats_header);
+                        break;
+
                 default:
                         log(LOG_ERR, "yakvm_vm_ioctl() get unknown ioctl %d",
                             ioctl);
@@ -227,12 +1142,6 @@ static int yakvm_vcpu_state_mmap(struct file *filp,
         int r;
         struct vcpu *vcpu = filp->private_data;
 
-        if (vma->vm_pgoff) {
-                log(LOG_ERR, "yakvm_vcpu_state_mmap() map at %ld "
-                    "instead of 0", vma->vm_pgoff);
-                return -EINVAL;
-        }
-
 	if (vma->vm_end - vma->vm_start != PAGE_SIZE) {
                 log(LOG_ERR, "yakvm_vcpu_state_mmap() map %ld bytes "
                     "instead of page size", vma->vm_end - vma->vm_start);
@@ -251,6 +1160,52 @@ static int yakvm_vcpu_state_mmap(struct file *filp,
         return 0;
 }
 
+/* share the trace ring with kernel and userspace */
+static int yakvm_vcpu_trace_mmap(struct file *filp,
+                                 struct vm_area_struct *vma)
+{
+        int r;
+        struct vcpu *vcpu = filp->private_data;
+
+        if (!vcpu->trace_ring) {
+                log(LOG_ERR, "yakvm_vcpu_trace_mmap() map before "
+                    "YAKVM_TRACE");
+                return -EINVAL;
+        }
+
+        if (vma->vm_end - vma->vm_start != YAKVM_TRACE_RING_SIZE) {
+                log(LOG_ERR, "yakvm_vcpu_trace_mmap() map %ld bytes "
+                    "instead of %d", vma->vm_end - vma->vm_start,
+                    YAKVM_TRACE_RING_SIZE);
+                return -EINVAL;
+        }
+
+        r = remap_vmalloc_range(vma, vcpu->trace_ring, 0);
+        if (r < 0) {
+                log(LOG_ERR, "remap_vmalloc_range() failed with error "
+                    "code %d", r);
+                return r;
+        }
+
+        return 0;
+}
+
+static int yakvm_vcpu_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+        switch (vma->vm_pgoff) {
+                case 0:
+                        return yakvm_vcpu_state_mmap(filp, vma);
+
+                case YAKVM_TRACE_RING_OFFSET >> PAGE_SHIFT:
+                        return yakvm_vcpu_trace_mmap(filp, vma);
+
+                default:
+                        log(LOG_ERR, "yakvm_vcpu_mmap() map at unknown "
+                            "offset %ld", vma->vm_pgoff);
+                        return -EINVAL;
+        }
+}
+
 /*
  * interface for userspace-vcpu interaction, describe how the
  * userspace emulator can manipulate the virtual cpu
@@ -258,7 +1213,7 @@ static int yakvm_vcpu_state_mmap(struct file *filp,
 const struct file_operations yakvm_vcpu_fops = {
         .release = yakvm_vcpu_release,
         .unlocked_ioctl = yakvm_vcpu_ioctl,
-        .mmap = yakvm_vcpu_state_mmap,
+        .mmap = yakvm_vcpu_mmap,
 };
 
 static inline void yakvm_vmcb_init_segment_register(
@@ -279,33 +1234,15 @@ static inline void yakvm_vmcb_init_descriptor_table_register(
         seg->base = base;
 }
 
-static inline void yakvm_vmcb_set_intercept(struct vmcb *vmcb,
-                                            uint32_t bit)
-{
-        assert(bit < 32 * MAX_INTERCEPT);
-        __set_bit(bit, (unsigned long *)&vmcb->control.intercepts);
-}
-
-static inline void yakvm_vmcb_set_exception_intercept(struct vmcb *vmcb,
-                                            uint32_t bit)
-{
-        yakvm_vmcb_set_intercept(vmcb, INTERCEPT_EXCEPTION_OFFSET + bit);
-}
-
 /*
  * initialize the *vmcb* for guest state according to "15.5" on page 501 at
  * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+ *
+ * Only the fields shared by all vcpus are set here, once for the
+ * template copied into each new vcpu by yakvm_vcpu_init_vmcb().
  */
-static void yakvm_vcpu_init_vmcb(struct vcpu *vcpu)
+static void yakvm_vmcb_init_template(struct vmcb *vmcb)
 {
-        /*
-         * kernel needs to initialize the *gvmcb* to setup the
-         * guest. However, it does not need to initialize the
-         * hvmcb* as it is only used to temporarily store the
-         * host state during guest execution.
-         */
-        struct vmcb *vmcb = vcpu->gctx.vmcb;
-
         /*
          * initialize the guest to the initial processor state
          * according to "14.1.3" on page 480 at
@@ -349,15 +1286,17 @@ static void yakvm_vcpu_init_vmcb(struct vcpu *vcpu)
         vmcb->save.dr6 = DR6_ACTIVE_LOW;
         vmcb->save.dr7 = DR7_FIXED_1;
 
+        yakvm_vmcb_set_intercept(vmcb, INTERCEPT_HLT);
+
         /*
-         * Enable the *X86_EFLAGS_TF* to enable single-step mode for
-         * debugging the guest code according to "13.1.4" on page 407 at
+         * Intercept the physical interrupts, so the host gets the cpu
+         * back for its interrupts, rescheduling and signals, and enable
+         * *V_INTR_MASKING* so that the guest *EFLAGS.IF* only masks the
+         * virtual interrupts according to "15.21.1" on page 532 at
          * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
          */
-        vmcb->save.rflags |= X86_EFLAGS_TF;
-        yakvm_vmcb_set_exception_intercept(vmcb, DB_VECTOR);
-
-        yakvm_vmcb_set_intercept(vmcb, INTERCEPT_HLT);
+        yakvm_vmcb_set_intercept(vmcb, INTERCEPT_INTR);
+        vmcb->control.int_ctl |= V_INTR_MASKING_MASK;
 
         /*
          * Enable IOIO intercepts to emulate the device
@@ -365,8 +1304,6 @@ static void yakvm_vcpu_init_vmcb(struct vcpu *vcpu)
          * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
          */
         yakvm_vmcb_set_intercept(vmcb, INTERCEPT_IOIO_PROT);
-        vmcb->control.iopm_base_pa = virt_to_phys(vcpu->iopm);
-        set_bit(YAKVM_PIO_HAWK, vcpu->iopm);
 
         /*
          * with Nested Paging Table(NPT) enabled, the nested page table,
@@ -379,7 +1316,6 @@ static void yakvm_vcpu_init_vmcb(struct vcpu *vcpu)
          * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
          */
         vmcb->control.nested_ctl |= SVM_NESTED_CTL_NP_ENABLE;
-        vmcb->control.nested_cr3 = vcpu->vm->vmm->ncr3;
 
         /*
          * *vmrun* instruction performs consistency checks on guest state,
@@ -392,26 +1328,45 @@ static void yakvm_vcpu_init_vmcb(struct vcpu *vcpu)
         implementation requires that the *vmrun* intercept always be set
         in the *vmcb* according to "15.9" on page 514 at
         https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf */
-        vmcb->control.asid = atomic_inc_return(&asid);          /* ensure
-        different guests can coexist in the TLB according to
-        "15.25.1" on page 548 at
-        https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf */
-        assert(vmcb->control.asid < cpuid_ebx(0x8000000a));    /* according
-        to "15.5.1" on page 503 at
-        https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf */
 }
 
-/* create the vcpu */
-struct vcpu* yakvm_create_vcpu(struct vm *vm)
+/* initialize the *gvmcb* of the vcpu from the template */
+static void yakvm_vcpu_init_vmcb(struct vcpu *vcpu)
+{
+        /*
+         * kernel needs to initialize the *gvmcb* to setup the
+         * guest. However, it does not need to initialize the
+         * hvmcb* as it is only used to temporarily store the
+         * host state during guest execution.
+         */
+        struct vmcb *vmcb = vcpu->gctx.vmcb;
+
+        copy_page(vmcb, yakvm_vmcb_template);
+
+        /* the *iopm* and the NPT are shared by the vcpus of the vm */
+        vmcb->control.iopm_base_pa = virt_to_phys(vcpu->vm->iopm->bitmap);
+        vmcb->control.nested_cr3 = vcpu->vm->vmm->ncr3;
+
+        /*
+         * ensure different guests can coexist in the TLB according to
+         * "15.25.1" on page 548 at
+         * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+         *
+         * The ASID is assigned by yakvm_vcpu_new_asid() on the physical
+         * cpu where the vcpu runs.
+         */
+        vcpu->cpu = -1;
+}
+
+/* allocate the vcpu with its pages, which form the bundle */
+static struct vcpu *yakvm_vcpu_alloc_bundle(void)
 {
-        struct page *state, *gvmcb, *hvmcb, *hsave, *iopm;
+        struct page *pages;
         struct vcpu *vcpu;
-        void *ret;
 
-        vcpu = kmalloc(sizeof(struct vcpu), GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+        vcpu = kmem_cache_alloc(yakvm_vcpu_cache, GFP_KERNEL_ACCOUNT);
         if (!vcpu) {
-                log(LOG_ERR, "kmalloc() failed");
-                ret = ERR_PTR(-ENOMEM);
+                log(LOG_ERR, "kmem_cache_alloc() failed");
                 goto out;
         }
 
@@ -420,94 +1375,181 @@ struct vcpu* yakvm_create_vcpu(struct vm *vm)
          * 4KB-aligned page which describes a guest to be executed
          * accroding to "15.5" on page 500 at
          * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+         *
+         * The *gvmcb* and the *state* share a single order-1 block.
          */
-        gvmcb = alloc_page(GFP_KERNEL_ACCOUNT | __GFP_ZERO);
-        if (!gvmcb) {
-                log(LOG_ERR, "alloc_page() failed");
-                ret = ERR_PTR(-ENOMEM);
+        pages = alloc_pages(GFP_KERNEL_ACCOUNT, YAKVM_VCPU_BUNDLE_ORDER);
+        if (!pages) {
+                log(LOG_ERR, "alloc_pages() failed");
                 goto free_vcpu;
         }
 
-        /*
-         * Considering that *vmrun* and *vmexit* only saves part or none
-         * of host state, kernel should also use *vmcb* with
-         * *vmsave* and *vmload* to restore the totaly host state
-         * according to "15.5.1" on page 501 at
-         * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
-         */
-        hvmcb = alloc_page(GFP_KERNEL_ACCOUNT | __GFP_ZERO);
-        if (!hvmcb) {
-                log(LOG_ERR, "alloc_page() failed");
-                ret = ERR_PTR(-ENOMEM);
-                goto free_gvmcb;
+        vcpu->gctx.vmcb = page_address(pages);
+        vcpu->state = page_address(pages + 1);
+        return vcpu;
+
+free_vcpu:
+        kmem_cache_free(yakvm_vcpu_cache, vcpu);
+out:
+        return NULL;
+}
+
+static void yakvm_vcpu_free_bundle(struct vcpu *vcpu)
+{
+        free_pages((unsigned long)vcpu->gctx.vmcb, YAKVM_VCPU_BUNDLE_ORDER);
+        kmem_cache_free(yakvm_vcpu_cache, vcpu);
+}
+
+/* take a reset bundle from the pool, or allocate a new one */
+static struct vcpu *yakvm_vcpu_get_bundle(void)
+{
+        struct vcpu *vcpu = NULL;
+        struct state *state;
+        struct vmcb *vmcb;
+
+        spin_lock(&yakvm_vcpu_pool_lock);
+        if (yakvm_vcpu_pool_nr) {
+                vcpu = yakvm_vcpu_pool[--yakvm_vcpu_pool_nr];
+        }
+        spin_unlock(&yakvm_vcpu_pool_lock);
+
+        if (!vcpu) {
+                vcpu = yakvm_vcpu_alloc_bundle();
+                if (!vcpu) {
+                        return NULL;
+                }
         }
 
         /*
-         * *hsave* is a 4KB block of memory where *vmrun* saves part or
-         * none of host state, and from which *vmexit* reloads saving
-         * host state according to "15.30.4" on page 585 at
-         * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+         * only the pages survive the reset, and the *gvmcb* is
+         * overwritten by the template later.
          */
-        hsave = alloc_page(GFP_KERNEL_ACCOUNT | __GFP_ZERO);
-        if (!hsave) {
-                log(LOG_ERR, "alloc_page() failed");
-                ret = ERR_PTR(-ENOMEM);
-                goto free_hvmcb;
+        vmcb = vcpu->gctx.vmcb;
+        state = vcpu->state;
+        memset(vcpu, 0, sizeof(*vcpu));
+        vcpu->gctx.vmcb = vmcb;
+        vcpu->state = state;
+        clear_page(state);
+
+        return vcpu;
+}
+
+/* return the bundle to the pool, or free it once the pool is full */
+static void yakvm_vcpu_put_bundle(struct vcpu *vcpu)
+{
+        spin_lock(&yakvm_vcpu_pool_lock);
+        if (yakvm_vcpu_pool_nr < vcpu_pool_size) {
+                yakvm_vcpu_pool[yakvm_vcpu_pool_nr++] = vcpu;
+                vcpu = NULL;
         }
+        spin_unlock(&yakvm_vcpu_pool_lock);
 
-	state = alloc_page(GFP_KERNEL_ACCOUNT | __GFP_ZERO);
-        if (!state) {
-                log(LOG_ERR, "alloc_page() failed");
-                ret = ERR_PTR(-ENOMEM);
-                goto free_hsave;
+        if (vcpu) {
+                yakvm_vcpu_free_bundle(vcpu);
         }
+}
 
-        /*
-         * The I/O Permissions Map(iopm) occupies 12 Kbytes of
-         * contiguous physical memory and must be aligned on a
-         * 4-Kbyte boundary according to "15.10.1" on page 515 at
-         * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
-         */
-        iopm = alloc_pages(GFP_KERNEL_ACCOUNT | __GFP_ZERO, get_order(12 KiB));
-        if (!iopm) {
-                log(LOG_ERR, "alloc_page() failed");
-                ret = ERR_PTR(-ENOMEM);
-                goto free_state;
+int yakvm_create_vcpu_pool(void)
+{
+        struct vcpu *vcpu;
+
+        yakvm_vcpu_cache = KMEM_CACHE(vcpu, SLAB_ACCOUNT);
+        if (!yakvm_vcpu_cache) {
+                log(LOG_ERR, "KMEM_CACHE() failed");
+                return -ENOMEM;
+        }
+
+        yakvm_vmcb_template = (void *)get_zeroed_page(GFP_KERNEL);
+        if (!yakvm_vmcb_template) {
+                log(LOG_ERR, "get_zeroed_page() failed");
+                goto destroy;
+        }
+        yakvm_vmcb_init_template(yakvm_vmcb_template);
+
+        yakvm_vcpu_pool = kcalloc(vcpu_pool_size, sizeof(*yakvm_vcpu_pool),
+                                  GFP_KERNEL);
+        if (!yakvm_vcpu_pool) {
+                log(LOG_ERR, "kcalloc() failed");
+                goto destroy;
+        }
+
+        /* fill the pool, so the first vcpus skip the page allocator */
+        while (yakvm_vcpu_pool_nr < vcpu_pool_size) {
+                vcpu = yakvm_vcpu_alloc_bundle();
+                if (!vcpu) {
+                        goto destroy;
+                }
+                yakvm_vcpu_pool[yakvm_vcpu_pool_nr++] = vcpu;
+        }
+
+        return 0;
+
+destroy:
+        yakvm_destroy_vcpu_pool();
+        return -ENOMEM;
+}
+
+void yakvm_destroy_vcpu_pool(void)
+{
+        while (yakvm_vcpu_pool_nr) {
+                yakvm_vcpu_free_bundle(yakvm_vcpu_pool[--yakvm_vcpu_pool_nr]);
+        }
+        kfree(yakvm_vcpu_pool);
+        free_page((unsigned long)yakvm_vmcb_template);
+        kmem_cache_destroy(yakvm_vcpu_cache);
+        yakvm_vcpu_pool = NULL;
+        yakvm_vmcb_template = NULL;
+        yakvm_vcpu_cache = NULL;
+}
+
+/* create the vcpu */
+struct vcpu* yakvm_create_vcpu(struct vm *vm, unsigned int id)
+{
+        char stats_id[YAKVM_STATS_MAX_ID];
+        struct stats_header *stats;
+        struct vcpu *vcpu;
+
+        vcpu = yakvm_vcpu_get_bundle();
+        if (!vcpu) {
+                log(LOG_ERR, "yakvm_vcpu_get_bundle() failed");
+                return ERR_PTR(-ENOMEM);
+        }
+
+        snprintf(stats_id, sizeof(stats_id), "%s/vcpu-%u", vm->id, id);
+        stats = yakvm_create_stats(yakvm_vcpu_stats_descs,
+                                   yakvm_vcpu_stats_num, stats_id);
+        if (IS_ERR(stats)) {
+                log(LOG_ERR, "yakvm_create_stats() failed with error code "
+                    "%ld", PTR_ERR(stats));
+                yakvm_vcpu_put_bundle(vcpu);
+                return ERR_CAST(stats);
         }
 
         /* initialize the vcpu */
         mutex_init(&vcpu->lock);
-        vcpu->gctx.vmcb = page_address(gvmcb);
-        vcpu->hctx.vmcb = page_address(hvmcb);
-        vcpu->hsave = page_address(hsave);
-        vcpu->iopm = page_address(iopm);
-        vcpu->state = page_address(state);
+        preempt_notifier_init(&vcpu->pn, &yakvm_vcpu_preempt_ops);
+        init_waitqueue_head(&vcpu->wq);
+        vcpu->stats_header = stats;
+        vcpu->stats = yakvm_stats_data(stats);
         vcpu->vm = vm;
+        vcpu->id = id;
         yakvm_vcpu_init_vmcb(vcpu);
 
         return vcpu;
-
-free_state:
-        __free_page(state);
-free_hsave:
-        __free_page(hsave);
-free_hvmcb:
-        __free_page(hvmcb);
-free_gvmcb:
-        __free_page(gvmcb);
-free_vcpu:
-        kfree(vcpu);
-out:
-        return ret;
 }
 
 /* destroy the vcpu */
 void yakvm_destroy_vcpu(struct vcpu *vcpu)
 {
-        free_page((unsigned long)vcpu->state);
-        free_pages((unsigned long)vcpu->iopm, get_order(12 KiB));
-        free_page((unsigned long)vcpu->hsave);
-        free_page((unsigned long)vcpu->hctx.vmcb);
-        free_page((unsigned long)vcpu->gctx.vmcb);
-        kfree(vcpu);
+        int cpu;
+
+        /* the *vmcb* may be reused by a new vcpu */
+        for_each_possible_cpu(cpu) {
+                cmpxchg(&per_cpu_ptr(&yakvm_host, cpu)->current_vmcb,
+                        vcpu->gctx.vmcb, NULL);
+        }
+
+        vfree(vcpu->trace_ring);
+        yakvm_destroy_stats(vcpu->stats_header);
+        yakvm_vcpu_put_bundle(vcpu);
 }
@@ -0,0 +1,403 @@
+#include <asm/barrier.h>
+#include <linux/err.h>
+#include <linux/eventfd.h>
+#include <linux/gfp.h>
+#include <linux/gfp_types.h>
+#include <linux/list.h>
+#include <linux/minmax.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/refcount.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include "../include/cpu.h"
+#include "../include/io.h"
+#include "../include/memory.h"
+#include "../include/vm.h"
+#include "../include/yakvm.h"
+
+static_assert(sizeof(struct coalesced_ring) +
+              YAKVM_COALESCED_RING_MAX * sizeof(struct coalesced_entry)
+              <= PAGE_SIZE);
+
+/* create the coalesced ring and its zones */
+struct coalesced *yakvm_create_coalesced(void)
+{
+        struct coalesced *coalesced;
+        struct page *ring;
+
+        coalesced = kmalloc(sizeof(*coalesced),
+                            GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+        if (!coalesced) {
+                log(LOG_ERR, "kmalloc() failed");
+                return ERR_PTR(-ENOMEM);
+        }
+
+        ring = alloc_page(GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+        if (!ring) {
+                log(LOG_ERR, "alloc_page() failed");
+                kfree(coalesced);
+                return ERR_PTR(-ENOMEM);
+        }
+
+        spin_lock_init(&coalesced->lock);
+        coalesced->ring = page_address(ring);
+
+        return coalesced;
+}
+
+/* destroy the coalesced ring and its zones */
+void yakvm_destroy_coalesced(struct coalesced *coalesced)
+{
+        free_page((unsigned long)coalesced->ring);
+        kfree(coalesced);
+}
+
+/* register the @zone whose writes are coalesced into the ring */
+int yakvm_coalesced_register(struct coalesced *coalesced,
+                             const struct coalesced_zone *zone)
+{
+        int r = 0;
+
+        if (!zone->size || (zone->type != YAKVM_IO_PIO &&
+                            zone->type != YAKVM_IO_MMIO)) {
+                return -EINVAL;
+        }
+
+        spin_lock(&coalesced->lock);
+        if (coalesced->nzones == YAKVM_COALESCED_MAX_ZONES) {
+                r = -ENOSPC;
+        } else {
+                coalesced->zones[coalesced->nzones++] = *zone;
+        }
+        spin_unlock(&coalesced->lock);
+
+        return r;
+}
+
+static bool yakvm_coalesced_match(const struct coalesced_zone *zone,
+                                  const struct io *io)
+{
+        return zone->type == io->type &&
+               io->address >= zone->address &&
+               io->address + io->size <= zone->address + zone->size;
+}
+
+/*
+ * append the write into the ring, return 1 if appended, 0 if the
+ * write is not in the registered zones, or -ENOSPC if the ring is
+ * full, so that the write is handled by the userspace synchronously,
+ * after the userspace drains the ring.
+ */
+static int yakvm_coalesced_write(struct coalesced *coalesced,
+                                 const struct io *io)
+{
+        struct coalesced_ring *ring = coalesced->ring;
+        struct coalesced_entry *entry;
+        uint32_t last;
+        int r = 0;
+
+        spin_lock(&coalesced->lock);
+
+        for (uint32_t i = 0; i < coalesced->nzones; ++i) {
+                if (yakvm_coalesced_match(&coalesced->zones[i], io)) {
+                        r = 1;
+                        break;
+                }
+        }
+        if (!r) {
+                goto unlock;
+        }
+
+        last = coalesced->last;
+        if ((last + 1) % YAKVM_COALESCED_RING_MAX == READ_ONCE(ring->first)) {
+                r = -ENOSPC;
+                goto unlock;
+        }
+
+        entry = &ring->entries[last];
+        entry->address = io->address;
+        entry->data = io->data;
+        entry->type = io->type;
+        entry->size = io->size;
+
+        /* publish the entry before the userspace sees the new *last* */
+        smp_wmb();
+        coalesced->last = (last + 1) % YAKVM_COALESCED_RING_MAX;
+        WRITE_ONCE(ring->last, coalesced->last);
+
+unlock:
+        spin_unlock(&coalesced->lock);
+        return r;
+}
+
+struct ioeventfd_item {
+        struct list_head list;
+        struct eventfd_ctx *eventfd;
+        struct ioeventfd args;
+};
+
+static bool yakvm_ioeventfd_same(const struct ioeventfd_item *item,
+                                 const struct ioeventfd *args,
+                                 const struct eventfd_ctx *eventfd)
+{
+        return item->eventfd == eventfd &&
+               item->args.address == args->address &&
+               item->args.size == args->size &&
+               ((item->args.flags ^ args->flags) &
+                (YAKVM_IOEVENTFD_FLAG_PIO |
+                 YAKVM_IOEVENTFD_FLAG_DATAMATCH)) == 0 &&
+               (!(args->flags & YAKVM_IOEVENTFD_FLAG_DATAMATCH) ||
+                item->args.datamatch == args->datamatch);
+}
+
+/* bind or unbind the guest PIO/MMIO write with the eventfd */
+int yakvm_ioeventfd(struct vm *vm, const struct ioeventfd *args)
+{
+        struct ioeventfd_item *item, *tmp;
+        struct eventfd_ctx *eventfd;
+        int r = -ENOENT;
+
+        if (args->size != 0 && args->size != 1 && args->size != 2 &&
+            args->size != 4 && args->size != 8) {
+                return -EINVAL;
+        }
+
+        eventfd = eventfd_ctx_fdget(args->fd);
+        if (IS_ERR(eventfd)) {
+                return PTR_ERR(eventfd);
+        }
+
+        if (args->flags & YAKVM_IOEVENTFD_FLAG_DEASSIGN) {
+                spin_lock(&vm->ioeventfds_lock);
+                list_for_each_entry_safe(item, tmp, &vm->ioeventfds, list) {
+                        if (yakvm_ioeventfd_same(item, args, eventfd)) {
+                                list_del(&item->list);
+                                eventfd_ctx_put(item->eventfd);
+                                kfree(item);
+                                r = 0;
+                                break;
+                        }
+                }
+                spin_unlock(&vm->ioeventfds_lock);
+                eventfd_ctx_put(eventfd);
+                return r;
+        }
+
+        item = kmalloc(sizeof(*item), GFP_KERNEL_ACCOUNT);
+        if (!item) {
+                log(LOG_ERR, "kmalloc() failed");
+                eventfd_ctx_put(eventfd);
+                return -ENOMEM;
+        }
+        item->eventfd = eventfd;
+        item->args = *args;
+
+        spin_lock(&vm->ioeventfds_lock);
+        list_add_tail(&item->list, &vm->ioeventfds);
+        spin_unlock(&vm->ioeventfds_lock);
+
+        return 0;
+}
+
+/* unbind all the eventfds of the vm */
+void yakvm_destroy_ioeventfds(struct vm *vm)
+{
+        struct ioeventfd_item *item, *tmp;
+
+        list_for_each_entry_safe(item, tmp, &vm->ioeventfds, list) {
+                list_del(&item->list);
+                eventfd_ctx_put(item->eventfd);
+                kfree(item);
+        }
+}
+
+static bool yakvm_ioeventfd_match(const struct ioeventfd *args,
+                                  const struct io *io)
+{
+        bool is_pio = args->flags & YAKVM_IOEVENTFD_FLAG_PIO;
+
+        if (is_pio != (io->type == YAKVM_IO_PIO) ||
+            args->address != io->address) {
+                return false;
+        }
+
+        if (args->size && args->size != io->size) {
+                return false;
+        }
+
+        return !(args->flags & YAKVM_IOEVENTFD_FLAG_DATAMATCH) ||
+               args->datamatch == io->data;
+}
+
+/* signal the eventfds bound with the write, return true if any */
+static bool yakvm_ioeventfd_write(struct vm *vm, const struct io *io)
+{
+        struct ioeventfd_item *item;
+        bool r = false;
+
+        spin_lock(&vm->ioeventfds_lock);
+        list_for_each_entry(item, &vm->ioeventfds, list) {
+                if (yakvm_ioeventfd_match(&item->args, io)) {
+                        eventfd_signal(item->eventfd, 1);
+                        r = true;
+                }
+        }
+        spin_unlock(&vm->ioeventfds_lock);
+
+        return r;
+}
+
+/*
+ * handle the guest PIO/MMIO write inside the kernel, return true if
+ * the guest can be resumed without exiting to the userspace.
+ *
+ * A zone may be both coalesced and bound to an eventfd, then the
+ * eventfd works as a doorbell for the userspace to drain the ring,
+ * so the write should be appended before signaling the eventfd.
+ */
+bool yakvm_io_write(struct vm *vm, const struct io *io)
+{
+        int r = yakvm_coalesced_write(vm->coalesced, io);
+
+        /* ring is full, let the userspace handle it in order */
+        if (r < 0) {
+                return false;
+        }
+
+        return yakvm_ioeventfd_write(vm, io) || r;
+}
+
+/*
+ * The I/O Permissions Map(iopm) occupies 12 Kbytes of contiguous
+ * physical memory and must be aligned on a 4-Kbyte boundary, where
+ * the bit of each port intercepts the access according to "15.10.1"
+ * on page 515 at
+ * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+ *
+ * alloc_pages_exact() gives the unused fourth page of the order-2
+ * block back to the page allocator.
+ */
+#define YAKVM_IOPM_SIZE         (12 KiB)
+#define YAKVM_IOPM_PORTS        (64 KiB)
+
+/* intercepts *YAKVM_PIO_HAWK* only, shared by the vms until they write */
+static struct iopm *yakvm_default_iopm;
+
+/* create the iopm with the bits copied from @src if any */
+static struct iopm *yakvm_create_iopm(const struct iopm *src, gfp_t gfp)
+{
+        struct iopm *iopm;
+
+        iopm = kmalloc(sizeof(*iopm), gfp);
+        if (!iopm) {
+                log(LOG_ERR, "kmalloc() failed");
+                return ERR_PTR(-ENOMEM);
+        }
+
+        iopm->bitmap = alloc_pages_exact(YAKVM_IOPM_SIZE, gfp | __GFP_ZERO);
+        if (!iopm->bitmap) {
+                log(LOG_ERR, "alloc_pages_exact() failed");
+                kfree(iopm);
+                return ERR_PTR(-ENOMEM);
+        }
+
+        if (src) {
+                memcpy(iopm->bitmap, src->bitmap, YAKVM_IOPM_SIZE);
+        }
+        refcount_set(&iopm->refcount, 1);
+
+        return iopm;
+}
+
+/* put the iopm, which is freed with its last reference */
+void yakvm_put_iopm(struct iopm *iopm)
+{
+        if (refcount_dec_and_test(&iopm->refcount)) {
+                free_pages_exact(iopm->bitmap, YAKVM_IOPM_SIZE);
+                kfree(iopm);
+        }
+}
+
+/* get the default iopm for the new vm */
+struct iopm *yakvm_get_default_iopm(void)
+{
+        refcount_inc(&yakvm_default_iopm->refcount);
+        return yakvm_default_iopm;
+}
+
+int yakvm_create_default_iopm(void)
+{
+        struct iopm *iopm = yakvm_create_iopm(NULL, GFP_KERNEL);
+
+        if (IS_ERR(iopm)) {
+                log(LOG_ERR, "yakvm_create_iopm() failed with error code "
+                    "%ld", PTR_ERR(iopm));
+                return PTR_ERR(iopm);
+        }
+
+        set_bit(YAKVM_PIO_HAWK, iopm->bitmap);
+        yakvm_default_iopm = iopm;
+
+        return 0;
+}
+
+void yakvm_destroy_default_iopm(void)
+{
+        yakvm_put_iopm(yakvm_default_iopm);
+        yakvm_default_iopm = NULL;
+}
+
+/*
+ * intercept the @size ports from @port on all vcpus of the @vm, or
+ * only the @port if @size is 0. The iopm shared with other vms is
+ * copied on write, while the iopm owned by the @vm is updated in
+ * place, and the ports stay intercepted until the vm is destroyed.
+ */
+int yakvm_iopm_intercept(struct vm *vm, uint64_t port, uint32_t size)
+{
+        uint64_t end = min_t(uint64_t, port + max(size, 1u),
+                             YAKVM_IOPM_PORTS);
+        struct iopm *iopm, *old;
+        struct vcpu *vcpu;
+        unsigned long index;
+        uint64_t p;
+        int r = 0;
+
+        mutex_lock(&vm->lock);
+
+        old = vm->iopm;
+        for (p = port; p < end && test_bit(p, old->bitmap); ++p) {
+        }
+        if (p >= end) {
+                goto unlock;
+        }
+
+        iopm = old;
+        if (refcount_read(&old->refcount) > 1) {
+                iopm = yakvm_create_iopm(old, GFP_KERNEL_ACCOUNT);
+                if (IS_ERR(iopm)) {
+                        r = PTR_ERR(iopm);
+                        log(LOG_ERR, "yakvm_create_iopm() failed with "
+                            "error code %d", r);
+                        goto unlock;
+                }
+        }
+
+        for (p = port; p < end; ++p) {
+                set_bit(p, iopm->bitmap);
+        }
+
+        /* the vcpus leave the old iopm before it is put */
+        if (iopm != old) {
+                WRITE_ONCE(vm->iopm, iopm);
+                xa_for_each(&vm->vcpus, index, vcpu) {
+                        yakvm_vcpu_reload_iopm(vcpu);
+                }
+                yakvm_put_iopm(old);
+        }
+
+unlock:
+        mutex_unlock(&vm->lock);
+        return r;
+}
@@ -0,0 +1,201 @@
+#include <linux/eventfd.h>
+#include <linux/file.h>
+#include <linux/gfp_types.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include "../include/cpu.h"
+#include "../include/irq.h"
+#include "../include/vm.h"
+#include "../include/yakvm.h"
+
+struct irqfd_item {
+        struct list_head list;
+        struct vm *vm;
+        struct eventfd_ctx *eventfd;
+        uint32_t vector;
+        uint32_t vcpu;
+        wait_queue_entry_t wait;
+        poll_table pt;
+};
+
+/*
+ * inject the interrupt into the vcpu bound with the irqfd, as there
+ * is no interrupt controller to route it.
+ */
+static void yakvm_irqfd_inject(struct irqfd_item *item)
+{
+        struct vcpu *vcpu;
+
+        /* the vcpu erased by yakvm_vm_ioctl_create_vcpu() is kept alive */
+        rcu_read_lock();
+        vcpu = xa_load(&item->vm->vcpus, item->vcpu);
+        if (vcpu) {
+                yakvm_vcpu_interrupt(vcpu, item->vector);
+        }
+        rcu_read_unlock();
+}
+
+/*
+ * called with the eventfd wait queue lock held when the
+ * eventfd is written, so it must not sleep.
+ */
+static int yakvm_irqfd_wakeup(wait_queue_entry_t *wait, unsigned int mode,
+                              int sync, void *key)
+{
+        struct irqfd_item *item = container_of(wait, struct irqfd_item,
+                                               wait);
+        __poll_t flags = key_to_poll(key);
+        uint64_t count;
+
+        if (flags & EPOLLIN) {
+                eventfd_ctx_do_read(item->eventfd, &count);
+                yakvm_irqfd_inject(item);
+        }
+
+        return 0;
+}
+
+static void yakvm_irqfd_ptable_queue_proc(struct file *file,
+                                          wait_queue_head_t *wqh,
+                                          poll_table *pt)
+{
+        struct irqfd_item *item = container_of(pt, struct irqfd_item, pt);
+
+        add_wait_queue(wqh, &item->wait);
+}
+
+static void yakvm_irqfd_free(struct irqfd_item *item)
+{
+        uint64_t count;
+
+        eventfd_ctx_remove_wait_queue(item->eventfd, &item->wait, &count);
+        eventfd_ctx_put(item->eventfd);
+        kfree(item);
+}
+
+static int yakvm_irqfd_assign(struct vm *vm, const struct irqfd *args)
+{
+        struct irqfd_item *item;
+        struct fd f;
+        __poll_t events;
+        int r;
+
+        item = kzalloc(sizeof(*item), GFP_KERNEL_ACCOUNT);
+        if (!item) {
+                log(LOG_ERR, "kzalloc() failed");
+                return -ENOMEM;
+        }
+        item->vm = vm;
+        item->vector = args->vector;
+        item->vcpu = args->vcpu;
+
+        f = fdget(args->fd);
+        if (!f.file) {
+                r = -EBADF;
+                goto free_item;
+        }
+
+        item->eventfd = eventfd_ctx_fileget(f.file);
+        if (IS_ERR(item->eventfd)) {
+                r = PTR_ERR(item->eventfd);
+                goto fdput;
+        }
+
+        /*
+         * install the custom wakeup function on the eventfd wait
+         * queue, so that the interrupt is injected without waking
+         * up any thread.
+         */
+        init_waitqueue_func_entry(&item->wait, yakvm_irqfd_wakeup);
+        init_poll_funcptr(&item->pt, yakvm_irqfd_ptable_queue_proc);
+
+        /* the eventfd may have been written before being bound */
+        events = vfs_poll(f.file, &item->pt);
+        if (events & EPOLLIN) {
+                uint64_t count;
+
+                eventfd_ctx_do_read(item->eventfd, &count);
+                yakvm_irqfd_inject(item);
+        }
+
+        mutex_lock(&vm->lock);
+        list_add_tail(&item->list, &vm->irqfds);
+        mutex_unlock(&vm->lock);
+
+        fdput(f);
+        return 0;
+
+fdput:
+        fdput(f);
+free_item:
+        kfree(item);
+        return r;
+}
+
+static int yakvm_irqfd_deassign(struct vm *vm, const struct irqfd *args)
+{
+        struct irqfd_item *item, *tmp;
+        struct eventfd_ctx *eventfd;
+        int r = -ENOENT;
+
+        eventfd = eventfd_ctx_fdget(args->fd);
+        if (IS_ERR(eventfd)) {
+                return PTR_ERR(eventfd);
+        }
+
+        mutex_lock(&vm->lock);
+        list_for_each_entry_safe(item, tmp, &vm->irqfds, list) {
+                if (item->eventfd == eventfd &&
+                    item->vector == args->vector &&
+                    item->vcpu == args->vcpu) {
+                        list_del(&item->list);
+                        yakvm_irqfd_free(item);
+                        r = 0;
+                        break;
+                }
+        }
+        mutex_unlock(&vm->lock);
+
+        eventfd_ctx_put(eventfd);
+        return r;
+}
+
+/* bind or unbind the eventfd with the interrupt vector */
+int yakvm_irqfd(struct vm *vm, const struct irqfd *args)
+{
+        bool created;
+
+        if (args->vector >= YAKVM_NR_VECTORS) {
+                return -EINVAL;
+        }
+
+        if (args->flags & YAKVM_IRQFD_FLAG_DEASSIGN) {
+                return yakvm_irqfd_deassign(vm, args);
+        }
+
+        /* the vcpus are never removed once created */
+        mutex_lock(&vm->lock);
+        created = xa_load(&vm->vcpus, args->vcpu);
+        mutex_unlock(&vm->lock);
+        if (!created) {
+                log(LOG_ERR, "vcpu %u is not created", args->vcpu);
+                return -ENOENT;
+        }
+
+        return yakvm_irqfd_assign(vm, args);
+}
+
+/* unbind all the eventfds of the vm */
+void yakvm_destroy_irqfds(struct vm *vm)
+{
+        struct irqfd_item *item, *tmp;
+
+        list_for_each_entry_safe(item, tmp, &vm->irqfds, list) {
+                list_del(&item->list);
+                yakvm_irqfd_free(item);
+        }
+}
@@ -1,3 +1,4 @@
+#include <asm/io.h>
 #include <asm/msr.h>
 #include <asm-generic/errno.h>
 #include <asm-generic/fcntl.h>
@@ -9,11 +10,18 @@
 #include <linux/file.h>
 #include <linux/miscdevice.h>
 #include <linux/module.h>
+#include <linux/preempt.h>
 #include <linux/smp.h>
 #include <linux/types.h>
+#include "../include/cpu.h"
+#include "../include/io.h"
+#include "../include/memory.h"
 #include "../include/vm.h"
 #include "../include/yakvm.h"
 
+#define CREATE_TRACE_POINTS
+#include "../include/trace.h"
+
 /* information for module */
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Hawkins Jiawei");
@@ -114,6 +122,24 @@ static void yakvm_cpu_svm_enable(void *data)
         uint64_t efer;
         rdmsrl(MSR_EFER, efer);
         wrmsrl(MSR_EFER, efer | EFER_SVME);
+
+        /*
+         * physical cpu *VM_HSAVE_PA* MSR holds the physical address
+         * of a block of memory where *vmrun* save host state and from
+         * which *vmexit* reloads host state according to "15.30.4" on
+         * page 585 at
+         * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf.
+         *
+         * Note that this setting is pcpu specific, so each pcpu
+         * owns its *hsave* and sets it only once here.
+         */
+        wrmsrl(MSR_VM_HSAVE_PA, virt_to_phys(this_cpu_read(yakvm_host.hsave)));
+}
+
+/* reset the *VM_HSAVE_PA* MSR before freeing the *hsave* */
+static void yakvm_cpu_svm_disable(void *data)
+{
+        wrmsrl(MSR_VM_HSAVE_PA, 0);
 }
 
 static int yakvm_init(void)
@@ -131,24 +157,91 @@ static int yakvm_init(void)
                 return -EOPNOTSUPP;
         }
 
-        /* exposes "/dev/yakvm" device to userspace */
-        ret = misc_register(&yakvm_dev);
+        ret = yakvm_create_hosts();
         if (ret) {
-                log(LOG_ERR, "misc_register() failed with error code %d",
+                log(LOG_ERR, "yakvm_create_hosts() failed with error code %d",
                     ret);
                 return ret;
         }
 
+        ret = yakvm_create_vm_cache();
+        if (ret) {
+                log(LOG_ERR, "yakvm_create_vm_cache() failed with error "
+                    "code %d", ret);
+                goto destroy_hosts;
+        }
+
+        ret = yakvm_create_vmm_cache();
+        if (ret) {
+                log(LOG_ERR, "yakvm_create_vmm_cache() failed with error "
+                    "code %d", ret);
+                goto destroy_vm_cache;
+        }
+
+        ret = yakvm_create_vcpu_pool();
+        if (ret) {
+                log(LOG_ERR, "yakvm_create_vcpu_pool() failed with error "
+                    "code %d", ret);
+                goto destroy_vmm_cache;
+        }
+
+        ret = yakvm_create_default_iopm();
+        if (ret) {
+                log(LOG_ERR, "yakvm_create_default_iopm() failed with "
+                    "error code %d", ret);
+                goto destroy_vcpu_pool;
+        }
+
+        ret = yakvm_create_vm_reaper();
+        if (ret) {
+                log(LOG_ERR, "yakvm_create_vm_reaper() failed with error "
+                    "code %d", ret);
+                goto destroy_default_iopm;
+        }
+
         /* enable svm on cpus */
         on_each_cpu(yakvm_cpu_svm_enable, NULL, 1);
+        preempt_notifier_inc();
+
+        /* exposes "/dev/yakvm" device to userspace */
+        ret = misc_register(&yakvm_dev);
+        if (ret) {
+                log(LOG_ERR, "misc_register() failed with error code %d",
+                    ret);
+                preempt_notifier_dec();
+                on_each_cpu(yakvm_cpu_svm_disable, NULL, 1);
+                goto destroy_vm_reaper;
+        }
 
         log(LOG_INFO, "initialize yakvm");
         return 0;
+
+destroy_vm_reaper:
+        yakvm_destroy_vm_reaper();
+destroy_default_iopm:
+        yakvm_destroy_default_iopm();
+destroy_vcpu_pool:
+        yakvm_destroy_vcpu_pool();
+destroy_vmm_cache:
+        yakvm_destroy_vmm_cache();
+destroy_vm_cache:
+        yakvm_destroy_vm_cache();
+destroy_hosts:
+        yakvm_destroy_hosts();
+        return ret;
 }
 
 static void yakvm_exit(void)
 {
         misc_deregister(&yakvm_dev);
+        preempt_notifier_dec();
+        on_each_cpu(yakvm_cpu_svm_disable, NULL, 1);
+        yakvm_destroy_vm_reaper();
+        yakvm_destroy_default_iopm();
+        yakvm_destroy_vcpu_pool();
+        yakvm_destroy_vmm_cache();
+        yakvm_destroy_vm_cache();
+        yakvm_destroy_hosts();
 
         assert(atomic_xchg(&yakvm_status, YAKVM_UNUSE) == YAKVM_INUSE);
 
@@ -1,41 +1,307 @@
+#include <asm/cpufeature.h>
 #include <asm/pgtable_types.h>
 #include <asm/io.h>
 #include <asm-generic/errno-base.h>
+#include <linux/atomic.h>
+#include <linux/bitops.h>
 #include <linux/pfn_t.h>
 #include <linux/pgtable.h>
 #include <linux/err.h>
 #include <linux/gfp.h>
 #include <linux/gfp_types.h>
+#include <linux/minmax.h>
 #include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/sched/mm.h>
+#include <linux/sched/signal.h>
+#include <linux/mutex.h>
 #include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
 #include "../include/memory.h"
+#include "../include/stats.h"
+#include "../include/trace.h"
+#include "../include/vm.h"
 #include "../include/yakvm.h"
 
-/* create the pte for @gpa */
-struct page *yakvm_vmm_npt_create(struct vmm *vmm, unsigned long gpa,
-                                  bool is_mmio)
+/*
+ * find the slot covering @gpa without any lock, which is safe because
+ * the slot is published by its *npages* after being initialized and
+ * never changes then, as yakvm_vmm_set_region().
+ */
+static struct memory_slot *yakvm_vmm_find_slot(struct vmm *vmm,
+                                               unsigned long gpa)
 {
-    struct table *table;
+    for (int idx = 0; idx < YAKVM_MAX_MEMORY_SLOTS; ++idx) {
+        struct memory_slot *slot = &vmm->slots[idx];
+        unsigned long npages = smp_load_acquire(&slot->npages);
+        if (npages && gpa >= slot->gpa &&
+            gpa - slot->gpa < npages << PAGE_SHIFT) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * count the populated leaf, whose total is published to the stats
+ * page read by the userspace, which may lag behind the counter but
+ * never goes back.
+ */
+static void yakvm_vmm_count_npt(struct vmm *vmm)
+{
+    uint64_t *stats = &vmm->vm->stats->npt_pages;
+    uint64_t value = atomic64_inc_return(&vmm->npt_pages);
+    uint64_t old = READ_ONCE(*stats);
+
+    while (old < value) {
+        uint64_t prev = cmpxchg(stats, old, value);
+        if (prev == old) {
+            break;
+        }
+        old = prev;
+    }
+}
+
+/*
+ * pin the @size bytes of userspace memory at @uaddr, and return the
+ * first page if all of them are mapped to the aligned pages of its
+ * folio in order, or NULL otherwise. Only the pin on the first page
+ * is kept, which holds the whole folio.
+ */
+static struct page *yakvm_vmm_pin_huge(unsigned long uaddr,
+                                       unsigned long size)
+{
+    unsigned long nr = size >> PAGE_SHIFT, done = 0;
+    struct page **pages, *first = NULL;
+    bool contiguous = true;
+    struct folio *folio;
+    long r;
+
+    pages = kmalloc_array(PTRS_PER_PAGE, sizeof(*pages), GFP_KERNEL);
+    if (!pages) {
+        return NULL;
+    }
+
+    while (contiguous && done < nr) {
+        r = pin_user_pages_fast(uaddr + (done << PAGE_SHIFT),
+                                min(nr - done, PTRS_PER_PAGE),
+                                FOLL_WRITE | FOLL_LONGTERM, pages);
+        if (r <= 0) {
+            break;
+        }
+
+        if (!done) {
+            first = pages[0];
+            folio = page_folio(first);
+            contiguous = IS_ALIGNED(page_to_pfn(first), nr) &&
+                         folio_pfn(folio) + folio_nr_pages(folio) >=
+                         page_to_pfn(first) + nr;
+        }
+        for (long idx = 0; idx < r; ++idx) {
+            contiguous &= page_to_pfn(pages[idx]) ==
+                          page_to_pfn(first) + done + idx;
+        }
+
+        unpin_user_pages(pages + !done, r - !done);
+        done += r;
+    }
+    kfree(pages);
+
+    if (!contiguous || done < nr) {
+        if (first) {
+            unpin_user_page(first);
+        }
+        return NULL;
+    }
+    return first;
+}
+
+/*
+ * pin the userspace page backing @gpa if it is covered by the slots,
+ * and return NULL for the guest ram allocated by the kernel.
+ *
+ * The huge page up to @max_level is preferred if the slot covers the
+ * whole aligned range around @gpa, and the range is mapped to one
+ * THP or hugetlb folio in order as yakvm_vmm_pin_huge(), whose level
+ * is returned in @level.
+ */
+static struct page *yakvm_vmm_pin_slot_page(struct vmm *vmm,
+                                            unsigned long gpa,
+                                            int max_level, int *level)
+{
+    unsigned long base, size, uaddr;
+    struct memory_slot *slot, copy = {};
     struct page *page;
-    int r, index;
+    int r;
+
+    *level = PT;
+
+    slot = yakvm_vmm_find_slot(vmm, gpa);
+    if (!slot) {
+        return NULL;
+    }
+    copy = *slot;
+
+    /* the slots belong to the userspace which registers them */
+    if (current->mm != vmm->mm) {
+        log(LOG_ERR, "gpa %#lx is accessed outside the vm process", gpa);
+        return ERR_PTR(-EIO);
+    }
+
+    /* the dirty pages are logged in 4K */
+    if (copy.dirty_bitmap) {
+        max_level = PT;
+    }
+
+    for (int lvl = max_level; lvl > PT; --lvl) {
+        if (lvl == PDPT && !boot_cpu_has(X86_FEATURE_GBPAGES)) {
+            continue;
+        }
+
+        size = level_size(lvl);
+        base = gpa & ~(size - 1);
+        uaddr = copy.uaddr + base - copy.gpa;
+        if (base < copy.gpa ||
+            base + size > copy.gpa + (copy.npages << PAGE_SHIFT) ||
+            !IS_ALIGNED(uaddr, size)) {
+            continue;
+        }
+
+        page = yakvm_vmm_pin_huge(uaddr, size);
+        if (page) {
+            *level = lvl;
+            return page;
+        }
+    }
+
+    /*
+     * The *FOLL_LONGTERM* migrates the page out of the movable zone
+     * and breaks the COW, since the NPT keeps it until the vm is
+     * destroyed.
+     */
+    uaddr = copy.uaddr + (gpa & PAGE_MASK) - copy.gpa;
+    r = pin_user_pages_fast(uaddr, 1, FOLL_WRITE | FOLL_LONGTERM, &page);
+    if (r != 1) {
+        r = r < 0 ? r : -EFAULT;
+        log(LOG_ERR, "pin_user_pages_fast() failed with error code %d", r);
+        return ERR_PTR(r);
+    }
+
+    return page;
+}
+
+/*
+ * split the @huge leaf at @level into a table of the leaves one level
+ * below, which map the same pages, so part of them can be changed.
+ *
+ * Return -EAGAIN if other thread has changed the leaf, whose table is
+ * used instead.
+ */
+static int yakvm_vmm_npt_split(struct table *table, int index, int level,
+                               unsigned long huge)
+{
+    unsigned long size = level_size(level - 1);
+    struct table *child;
+    struct page *page;
+
+    page = alloc_page(GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+    if (!page) {
+        log(LOG_ERR, "alloc_page() failed");
+        return -ENOMEM;
+    }
+
+    /* only the first leaf keeps the pin of the huge leaf */
+    child = page_address(page);
+    for (int idx = 0; idx < PTRS_PER_PAGE; ++idx) {
+        unsigned long leaf = (yakvm_vmm_page(huge) + idx * size) |
+                             (huge & ~PAGE_MASK);
+        if (idx) {
+            leaf = (leaf & ~YAKVM_NPT_PINNED) | YAKVM_NPT_BORROWED;
+        }
+        if (level - 1 == PT) {
+            leaf &= ~_PAGE_PSE;
+        }
+        child->entrys[idx] = leaf;
+    }
+
+    if (cmpxchg(&table->entrys[index], huge, page_to_phys(page) |
+                _PAGE_PRESENT | _PAGE_RW | _PAGE_USER) != huge) {
+        __free_page(page);
+        return -EAGAIN;
+    }
+    return 0;
+}
+
+/*
+ * create the pte for @gpa, and tell in @created whether the leaf is
+ * installed by this call rather than found populated.
+ */
+static struct page *yakvm_vmm_npt_install(struct vmm *vmm, unsigned long gpa,
+                                          bool is_mmio, bool *created)
+{
+    int r, index, level, leaf_level, max_level = PDPT;
+    struct page *page, *pinned = NULL;
+    unsigned long entry, parent;
+    struct table *table;
+    bool flush = false;
+
+retry:
+    r = 0;
+    leaf_level = PT;
+    if (!is_mmio) {
+        pinned = yakvm_vmm_pin_slot_page(vmm, gpa, max_level, &leaf_level);
+        if (IS_ERR(pinned)) {
+            return pinned;
+        }
+    }
+
     /*
      * the cr3 layout is described in "5.3.2" on page 140 at
      * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf.
      */
-    unsigned long entry = vmm->ncr3;
+    parent = vmm->ncr3;
 
-    for (int level = PML4T; level >= PT; --level) {
+    /*
+     * vcpus and the userspace may fault on the same tables
+     * concurrently, so each entry is installed by *cmpxchg*, and the
+     * loser frees its page and walks through the winner's entry. The
+     * lockless readers only see the fully initialized entries.
+     */
+    for (level = PML4T; ; ) {
         index = table_index(gpa, level);
-        table = yakvm_vmm_phys_to_virt(entry);
-        entry = table->entrys[index];
-        if (!entry) {
-            /* create *level* entry if needed */
-            page = alloc_page(GFP_KERNEL_ACCOUNT | __GFP_ZERO);
-            if (!page) {
-                log(LOG_ERR, "alloc_page() failed");
-                r = -ENOMEM;
+        table = yakvm_vmm_phys_to_virt(parent);
+        entry = READ_ONCE(table->entrys[index]);
+        if (entry && level > PT && is_leaf(entry, level)) {
+            if (!is_mmio) {
+                r = -EEXIST;
+                break;
+            }
+
+            /* the mmio only takes its own page out of the huge page */
+            r = yakvm_vmm_npt_split(table, index, level, entry);
+            if (r && r != -EAGAIN) {
                 goto out;
             }
+            flush |= !r;
+            r = 0;
+            continue;
+        } else if (entry && level > PT && level == leaf_level) {
+            /* the range has been mapped by the smaller pages */
+            r = -EAGAIN;
+            goto out;
+        } else if (!entry) {
+            /* create *level* entry if needed */
+            if (level == leaf_level && pinned) {
+                page = pinned;
+            } else {
+                page = alloc_page(GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+                if (!page) {
+                    log(LOG_ERR, "alloc_page() failed");
+                    r = -ENOMEM;
+                    goto out;
+                }
+            }
 
             /*
              * entry layout is described in "5.3.3" on page 144 at
@@ -50,11 +316,41 @@ struct page *yakvm_vmm_npt_create(struct vmm *vmm, unsigned long gpa,
              * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf.
              */
             entry = page_to_phys(page) | _PAGE_PRESENT | _PAGE_RW | _PAGE_USER;
-            table->entrys[index] = entry;
+            if (page == pinned) {
+                entry |= YAKVM_NPT_PINNED;
+                if (level > PT) {
+                    entry |= _PAGE_PSE;
+                }
+
+                /* the first write to the logged page is intercepted */
+                if (yakvm_vmm_find_slot(vmm, gpa)->dirty_bitmap) {
+                    entry &= ~_PAGE_RW;
+                }
+            }
+
+            if (cmpxchg(&table->entrys[index], 0, entry)) {
+                if (page != pinned) {
+                    __free_page(page);
+                }
+                continue;
+            }
+
+            if (page == pinned) {
+                pinned = NULL;
+            }
         } else if (level == PT) {
             r = -EEXIST;
         }
-        assert((entry & _PAGE_PRESENT) && (entry & _PAGE_RW) && (entry & _PAGE_USER));
+
+        /* the leaf may be the mmio or write-protected */
+        assert((entry & _PAGE_USER) && (is_leaf(entry, level) ||
+               ((entry & _PAGE_PRESENT) && (entry & _PAGE_RW))));
+
+        if (is_leaf(entry, level)) {
+            break;
+        }
+        parent = entry;
+        --level;
     }
 
     if (is_mmio) {
@@ -64,15 +360,537 @@ struct page *yakvm_vmm_npt_create(struct vmm *vmm, unsigned long gpa,
          * operations according to "15.25.6" on page 551 at
          * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf.
 	     */
-        table->entrys[index] &= ~(_PAGE_PRESENT);
+        clear_bit(_PAGE_BIT_PRESENT, &table->entrys[index]);
+        flush |= r == -EEXIST;
     }
 
-    return pfn_to_page(entry >> PAGE_SHIFT);
+    /* other vcpu has populated the leaf */
+    if (pinned) {
+        unpin_user_page(pinned);
+    }
+
+    if (flush) {
+        yakvm_vm_flush_tlb(vmm->vm);
+    }
+
+    *created = r != -EEXIST;
+    if (*created) {
+        yakvm_vmm_count_npt(vmm);
+        trace_yakvm_npt_populate(gpa, entry & PAGE_MASK, is_mmio);
+    }
+
+    return pfn_to_page((yakvm_vmm_page(entry) +
+                        (gpa & (level_size(level) - 1))) >> PAGE_SHIFT);
 
 out:
+    if (pinned) {
+        unpin_user_page(pinned);
+    }
+
+    if (flush) {
+        yakvm_vm_flush_tlb(vmm->vm);
+    }
+
+    /* fall back to the 4K page */
+    if (r == -EAGAIN) {
+        max_level = PT;
+        goto retry;
+    }
     return ERR_PTR(r);
 }
 
+/* create the pte for @gpa */
+struct page *yakvm_vmm_npt_create(struct vmm *vmm, unsigned long gpa,
+                                  bool is_mmio)
+{
+    bool created;
+
+    return yakvm_vmm_npt_install(vmm, gpa, is_mmio, &created);
+}
+
+/*
+ * turn the guest ram in [@gpa, @gpa + @size) into the mmio, e.g. the
+ * coalesced zone inside a slot, whose leaves are created or split
+ * out of the huge leaves without *_PAGE_PRESENT* as
+ * yakvm_vmm_npt_create(). The gpa outside the ram is the mmio already.
+ */
+int yakvm_vmm_set_mmio(struct vmm *vmm, unsigned long gpa,
+                       unsigned long size)
+{
+    unsigned long end;
+    struct page *page;
+
+    if (gpa + size < gpa) {
+        return -EINVAL;
+    }
+    end = PAGE_ALIGN(gpa + size);
+
+    for (gpa &= PAGE_MASK; gpa < end; gpa += PAGE_SIZE) {
+        if (fatal_signal_pending(current)) {
+            return -EINTR;
+        }
+        cond_resched();
+
+        if (!yakvm_vmm_is_ram(vmm, gpa)) {
+            continue;
+        }
+
+        page = yakvm_vmm_npt_create(vmm, gpa, true);
+        if (IS_ERR(page)) {
+            return PTR_ERR(page);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * populate the 4K leaves of the slot for [@gpa, @end) inside one PT,
+ * whose table has been created, by pinning the pages in one batch
+ * and filling the PT with one walk. Return the number of pages
+ * walked, or 0 if @gpa is not covered by the slots, and add the
+ * leaves installed by this call to @mapped.
+ */
+static long yakvm_vmm_npt_fill(struct vmm *vmm, unsigned long gpa,
+                               unsigned long end, struct page **pages,
+                               long *mapped)
+{
+    unsigned long uaddr, flags = _PAGE_RW;
+    struct memory_slot *slot;
+    struct table *table;
+    unsigned long entry;
+    int level;
+    long nr;
+
+    slot = yakvm_vmm_find_slot(vmm, gpa);
+    if (!slot || current->mm != vmm->mm) {
+        return 0;
+    }
+
+    uaddr = slot->uaddr + gpa - slot->gpa;
+    end = min(end, slot->gpa + (slot->npages << PAGE_SHIFT));
+
+    /* the first write to the logged page is intercepted */
+    if (slot->dirty_bitmap) {
+        flags = 0;
+    }
+
+    nr = pin_user_pages_fast(uaddr, (end - gpa) >> PAGE_SHIFT,
+                             FOLL_WRITE | FOLL_LONGTERM, pages);
+    if (nr <= 0) {
+        return nr;
+    }
+
+    entry = vmm->ncr3;
+    for (level = PML4T; level > PT; --level) {
+        table = yakvm_vmm_phys_to_virt(entry);
+        entry = READ_ONCE(table->entrys[table_index(gpa, level)]);
+        if (is_leaf(entry, level)) {
+            break;
+        }
+    }
+
+    /* the PT may be replaced by a huge leaf meanwhile */
+    if (level == PT) {
+        table = yakvm_vmm_phys_to_virt(entry);
+        for (long idx = 0; idx < nr; ++idx) {
+            unsigned long addr = gpa + (idx << PAGE_SHIFT);
+            int index = table_index(addr, PT);
+
+            entry = page_to_phys(pages[idx]) | _PAGE_PRESENT | flags |
+                    _PAGE_USER | YAKVM_NPT_PINNED;
+            if (cmpxchg(&table->entrys[index], 0, entry)) {
+                continue;
+            }
+            pages[idx] = NULL;
+            ++*mapped;
+
+            yakvm_vmm_count_npt(vmm);
+            trace_yakvm_npt_populate(addr, entry & PAGE_MASK, false);
+        }
+    }
+
+    for (long idx = 0; idx < nr; ++idx) {
+        if (pages[idx]) {
+            unpin_user_page(pages[idx]);
+        }
+    }
+
+    return nr;
+}
+
+/*
+ * populate the NPT for the guest ram in [@gpa, @gpa + @size), and
+ * return the number of 4K pages mapped by this call, or the error
+ * stopping it.
+ *
+ * The first page of each span creates the intermediate tables or
+ * the huge leaf, and the rest of the PT is filled in one batch with
+ * @pages, which holds *PTRS_PER_PAGE* pages.
+ */
+long yakvm_vmm_prefault(struct vmm *vmm, unsigned long gpa,
+                        unsigned long size, struct page **pages)
+{
+    unsigned long end, next, top = vmm->memory;
+    struct page *page;
+    long mapped = 0, r;
+    bool created;
+    entry *pte;
+    int level;
+
+    if (gpa + size < gpa) {
+        return -EINVAL;
+    }
+
+    /* nothing above the ram is populated, however large @size is */
+    for (int idx = 0; idx < YAKVM_MAX_MEMORY_SLOTS; ++idx) {
+        struct memory_slot *slot = &vmm->slots[idx];
+        unsigned long npages = smp_load_acquire(&slot->npages);
+        if (npages) {
+            top = max(top, slot->gpa + (npages << PAGE_SHIFT));
+        }
+    }
+    end = min(PAGE_ALIGN(gpa + size), top);
+    gpa &= PAGE_MASK;
+
+    while (gpa < end) {
+        if (fatal_signal_pending(current)) {
+            return -EINTR;
+        }
+        cond_resched();
+
+        if (!yakvm_vmm_is_ram(vmm, gpa)) {
+            gpa += PAGE_SIZE;
+            continue;
+        }
+
+        page = yakvm_vmm_npt_install(vmm, gpa, false, &created);
+        if (IS_ERR(page)) {
+            return PTR_ERR(page);
+        }
+
+        /* the leaf may be split or turned into the mmio meanwhile */
+        pte = yakvm_vmm_npt_lookup(vmm, gpa, &level);
+        if (!pte) {
+            log(LOG_ERR, "gpa %#lx has no leaf after populated", gpa);
+            return -EFAULT;
+        }
+        if (!(READ_ONCE(*pte) & _PAGE_PRESENT)) {
+            gpa += PAGE_SIZE;
+            continue;
+        }
+
+        next = min(end, (gpa & ~(level_size(level) - 1)) + level_size(level));
+        if (created) {
+            mapped += (next - gpa) >> PAGE_SHIFT;
+        }
+        if (level == PT) {
+            r = 1;
+            next = min(end, (gpa & ~(level_size(PDT) - 1)) + level_size(PDT));
+            if (gpa + PAGE_SIZE < next) {
+                r = yakvm_vmm_npt_fill(vmm, gpa + PAGE_SIZE, next, pages,
+                                       &mapped);
+                if (r < 0) {
+                    return r;
+                }
+                ++r;
+            }
+            next = gpa + (r << PAGE_SHIFT);
+        }
+
+        mapped += (next - gpa) >> PAGE_SHIFT;
+        gpa = next;
+    }
+
+    return mapped;
+}
+
+/* find the leaf for @gpa at @level, or NULL if it has not been created */
+entry *yakvm_vmm_npt_lookup(struct vmm *vmm, unsigned long gpa, int *level)
+{
+    struct table *table;
+    unsigned long entry = vmm->ncr3;
+    int index;
+
+    for (int lvl = PML4T; lvl >= PT; --lvl) {
+        table = yakvm_vmm_phys_to_virt(entry);
+        index = table_index(gpa, lvl);
+        entry = READ_ONCE(table->entrys[index]);
+        if (!entry) {
+            return NULL;
+        }
+
+        if (is_leaf(entry, lvl)) {
+            if (level) {
+                *level = lvl;
+            }
+            return &table->entrys[index];
+        }
+    }
+
+    /* never reach here */
+    assert(false);
+}
+
+/*
+ * return the kernel page backing the ram at @gpa for the mmap() of the
+ * vm fd, which is populated if needed, or NULL if the gpa is not the
+ * ram or is backed by the slots, whose pages are mapped by the
+ * userspace itself.
+ */
+struct page *yakvm_vmm_host_page(struct vmm *vmm, unsigned long gpa)
+{
+    if (!yakvm_vmm_is_ram(vmm, gpa) || yakvm_vmm_find_slot(vmm, gpa)) {
+        return NULL;
+    }
+
+    return yakvm_vmm_npt_create(vmm, gpa, false);
+}
+
+/*
+ * check whether @gpa is backed by the guest ram, which is either
+ * covered by the slots or below the vmm->memory, instead of the
+ * mmio, whose pte is created without *_PAGE_PRESENT* as
+ * yakvm_vmm_npt_create().
+ */
+bool yakvm_vmm_is_ram(struct vmm *vmm, unsigned long gpa)
+{
+    entry *pte;
+
+    if (gpa >= vmm->memory && !yakvm_vmm_find_slot(vmm, gpa)) {
+        return false;
+    }
+
+    pte = yakvm_vmm_npt_lookup(vmm, gpa, NULL);
+    return !pte || (READ_ONCE(*pte) & _PAGE_PRESENT);
+}
+
+/* read @len bytes at @gpa from the populated guest ram into @buf */
+int yakvm_vmm_read(struct vmm *vmm, unsigned long gpa,
+                   void *buf, unsigned long len)
+{
+    while (len) {
+        unsigned long offset = gpa & ~PAGE_MASK;
+        unsigned long size = min(len, PAGE_SIZE - offset);
+        int level;
+        entry *pte = yakvm_vmm_npt_lookup(vmm, gpa, &level);
+
+        if (!pte || !(*pte & _PAGE_PRESENT)) {
+            return -EFAULT;
+        }
+
+        memcpy(buf, yakvm_vmm_phys_to_virt(yakvm_vmm_page(*pte) +
+                                           (gpa & (level_size(level) - 1))) +
+               offset, size);
+        gpa += size;
+        buf += size;
+        len -= size;
+    }
+
+    return 0;
+}
+
+/* size of the dirty bitmap for @npages pages, rounded up to 64 bits */
+static inline unsigned long yakvm_vmm_dirty_bitmap_size(unsigned long npages)
+{
+    return BITS_TO_LONGS(npages) * sizeof(long);
+}
+
+/* register the @region backed by the userspace memory */
+int yakvm_vmm_set_region(struct vmm *vmm, const struct memory_region *region)
+{
+    unsigned long *dirty_bitmap = NULL;
+    struct memory_slot *slot;
+    int r = 0;
+
+    if (region->slot >= YAKVM_MAX_MEMORY_SLOTS ||
+        region->flags & ~YAKVM_MEM_LOG_DIRTY_PAGES) {
+        log(LOG_ERR, "invalid slot %u or flags %#x",
+            region->slot, region->flags);
+        return -EINVAL;
+    }
+
+    if (!region->size || !PAGE_ALIGNED(region->gpa) ||
+        !PAGE_ALIGNED(region->size) || !PAGE_ALIGNED(region->uaddr) ||
+        region->gpa + region->size < region->gpa ||
+        region->gpa + region->size > PHYS_ADDR_MASK + 1) {
+        log(LOG_ERR, "invalid region [%#llx, %#llx)",
+            region->gpa, region->gpa + region->size);
+        return -EINVAL;
+    }
+
+    if (!access_ok((void __user *)region->uaddr, region->size)) {
+        log(LOG_ERR, "invalid uaddr %#llx", region->uaddr);
+        return -EFAULT;
+    }
+
+    if (region->flags & YAKVM_MEM_LOG_DIRTY_PAGES) {
+        dirty_bitmap = kvzalloc(yakvm_vmm_dirty_bitmap_size(
+                                    region->size >> PAGE_SHIFT),
+                                GFP_KERNEL_ACCOUNT);
+        if (!dirty_bitmap) {
+            log(LOG_ERR, "kvzalloc() failed");
+            return -ENOMEM;
+        }
+    }
+
+    mutex_lock(&vmm->lock);
+    if (vmm->slots[region->slot].npages) {
+        log(LOG_ERR, "slot %u has been registered", region->slot);
+        r = -EEXIST;
+        goto out;
+    }
+
+    for (int idx = 0; idx < YAKVM_MAX_MEMORY_SLOTS; ++idx) {
+        slot = &vmm->slots[idx];
+        if (slot->npages &&
+            region->gpa < slot->gpa + (slot->npages << PAGE_SHIFT) &&
+            slot->gpa < region->gpa + region->size) {
+            log(LOG_ERR, "region overlaps with slot %d", idx);
+            r = -EEXIST;
+            goto out;
+        }
+    }
+
+    /*
+     * the region shadows the kernel ram below the vmm->memory it
+     * covers, which must not be populated yet, or its leaves would
+     * keep shadowing the region instead.
+     */
+    for (unsigned long gpa = region->gpa;
+         gpa < min(region->gpa + region->size, vmm->memory);
+         gpa += PAGE_SIZE) {
+        entry *pte = yakvm_vmm_npt_lookup(vmm, gpa, NULL);
+        if (pte && (READ_ONCE(*pte) & _PAGE_PRESENT)) {
+            log(LOG_ERR, "region overlaps with the populated ram "
+                "at %#lx", gpa);
+            r = -EEXIST;
+            goto out;
+        }
+        cond_resched();
+    }
+
+    /* publish the slot to the lockless readers by its *npages* */
+    slot = &vmm->slots[region->slot];
+    slot->gpa = region->gpa;
+    slot->uaddr = region->uaddr;
+    slot->dirty_bitmap = dirty_bitmap;
+    smp_store_release(&slot->npages, region->size >> PAGE_SHIFT);
+    dirty_bitmap = NULL;
+
+out:
+    mutex_unlock(&vmm->lock);
+    kvfree(dirty_bitmap);
+    return r;
+}
+
+/*
+ * log the write to the write-protected leaf of the dirty logged slot
+ * on the write *NPF*, and make the leaf writable until the bitmap is
+ * fetched, and return whether @gpa is logged.
+ */
+bool yakvm_vmm_log_dirty(struct vmm *vmm, unsigned long gpa)
+{
+    struct memory_slot *slot;
+    entry *pte;
+
+    slot = yakvm_vmm_find_slot(vmm, gpa);
+    pte = yakvm_vmm_npt_lookup(vmm, gpa, NULL);
+    if (!slot || !slot->dirty_bitmap || !pte ||
+        !(READ_ONCE(*pte) & _PAGE_PRESENT)) {
+        return false;
+    }
+
+    /*
+     * The leaf is made writable before the bit is logged, so the
+     * bit fetched by yakvm_vmm_get_dirty_log() in between is logged
+     * again and write-protects the leaf in the next round.
+     */
+    set_bit(_PAGE_BIT_RW, pte);
+    set_bit((gpa - slot->gpa) >> PAGE_SHIFT, slot->dirty_bitmap);
+
+    return true;
+}
+
+/*
+ * fetch and clear the dirty bitmap of @slot into the userspace @bitmap,
+ * whose pages are write-protected again before the bitmap is cleared,
+ * and the TLB is flushed before returning, so no write is lost.
+ */
+int yakvm_vmm_get_dirty_log(struct vmm *vmm, uint32_t slot,
+                            void __user *bitmap)
+{
+    unsigned long *dirty_bitmap, *bits;
+    unsigned long size, gpa, bit;
+    bool flush = false;
+    entry *pte;
+    int r = 0;
+
+    if (slot >= YAKVM_MAX_MEMORY_SLOTS) {
+        log(LOG_ERR, "invalid slot %u", slot);
+        return -EINVAL;
+    }
+
+    /* the slot can not be changed once registered */
+    size = yakvm_vmm_dirty_bitmap_size(
+               smp_load_acquire(&vmm->slots[slot].npages));
+    dirty_bitmap = vmm->slots[slot].dirty_bitmap;
+    gpa = vmm->slots[slot].gpa;
+    if (!dirty_bitmap) {
+        log(LOG_ERR, "slot %u does not log the dirty pages", slot);
+        return -ENOENT;
+    }
+
+    bits = kvmalloc(size, GFP_KERNEL_ACCOUNT);
+    if (!bits) {
+        log(LOG_ERR, "kvmalloc() failed");
+        return -ENOMEM;
+    }
+
+    for (unsigned long idx = 0; idx < size / sizeof(long); ++idx) {
+        bits[idx] = xchg(&dirty_bitmap[idx], 0);
+        for_each_set_bit(bit, &bits[idx], BITS_PER_LONG) {
+            pte = yakvm_vmm_npt_lookup(vmm, gpa + ((idx * BITS_PER_LONG +
+                                                    bit) << PAGE_SHIFT),
+                                       NULL);
+            if (pte) {
+                clear_bit(_PAGE_BIT_RW, pte);
+                flush = true;
+            }
+        }
+    }
+
+    if (flush) {
+        yakvm_vm_flush_tlb(vmm->vm);
+    }
+
+    if (copy_to_user(bitmap, bits, size)) {
+        log(LOG_ERR, "copy_to_user() failed");
+        r = -EFAULT;
+    }
+
+    kvfree(bits);
+    return r;
+}
+
+static struct kmem_cache *yakvm_vmm_cache;
+
+int yakvm_create_vmm_cache(void)
+{
+    yakvm_vmm_cache = KMEM_CACHE(vmm, SLAB_ACCOUNT);
+    if (!yakvm_vmm_cache) {
+        log(LOG_ERR, "KMEM_CACHE() failed");
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+void yakvm_destroy_vmm_cache(void)
+{
+    kmem_cache_destroy(yakvm_vmm_cache);
+}
+
 struct vmm *yakvm_create_vmm(struct vm *vm)
 {
     int r;
@@ -97,15 +915,19 @@ struct vmm *yakvm_create_vmm(struct vm *vm)
         goto out;
     }
 
-    vmm = kmalloc(sizeof(*vmm), GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+    vmm = kmem_cache_zalloc(yakvm_vmm_cache, GFP_KERNEL_ACCOUNT);
     if (!vmm) {
-        log(LOG_ERR, "kmalloc() failed");
+        log(LOG_ERR, "kmem_cache_zalloc() failed");
         r = -ENOMEM;
         goto free_pml4;
     }
 
     /* initialize the vmm */
+    mutex_init(&vmm->lock);
     vmm->ncr3 = page_to_phys(pml4t);
+    vmm->memory = YAKVM_MEMORY;
+    vmm->mm = current->mm;
+    mmgrab(vmm->mm);
     vmm->vm = vm;
 
     mmio = yakvm_vmm_npt_create(vmm, YAKVM_MMIO_HAWK, true);
@@ -119,32 +941,86 @@ struct vmm *yakvm_create_vmm(struct vm *vm)
     return vmm;
 
 free_vmm:
-    kfree(vmm);
+    mmdrop(vmm->mm);
+    kmem_cache_free(yakvm_vmm_cache, vmm);
 free_pml4:
     __free_page(pml4t);
 out:
     return ERR_PTR(r);
 }
 
-static void yakvm_vmm_destroy_table(struct table *table, int level)
+/*
+ * pages released in batches while tearing down the NPT, so the pinned
+ * pages are unpinned and the tables are freed a batch at a time, and
+ * the teardown of a large vm yields the cpu between the batches.
+ */
+#define YAKVM_TEARDOWN_BATCH    64
+struct teardown {
+    struct page *pinned[YAKVM_TEARDOWN_BATCH];
+    unsigned int npinned;
+    struct page *freed[YAKVM_TEARDOWN_BATCH];
+    unsigned int nfreed;
+};
+
+static void yakvm_vmm_teardown_flush(struct teardown *td)
+{
+    unpin_user_pages(td->pinned, td->npinned);
+    release_pages(td->freed, td->nfreed);
+    td->npinned = 0;
+    td->nfreed = 0;
+    cond_resched();
+}
+
+static void yakvm_vmm_teardown_unpin(struct teardown *td, struct page *page)
+{
+    td->pinned[td->npinned++] = page;
+    if (td->npinned == YAKVM_TEARDOWN_BATCH) {
+        yakvm_vmm_teardown_flush(td);
+    }
+}
+
+static void yakvm_vmm_teardown_free(struct teardown *td, void *addr)
+{
+    td->freed[td->nfreed++] = virt_to_page(addr);
+    if (td->nfreed == YAKVM_TEARDOWN_BATCH) {
+        yakvm_vmm_teardown_flush(td);
+    }
+}
+
+/* the @table is queued after its entries, as it is not read again */
+static void yakvm_vmm_destroy_table(struct teardown *td,
+                                    struct table *table, int level)
 {
     for (int idx = 0; idx < PTRS_PER_PAGE; ++idx) {
         unsigned long entry = table->entrys[idx];
         if (entry) {
-            assert((entry & _PAGE_USER) && (entry & _PAGE_RW));
-            if (level == PT) {
-                free_page((unsigned long)yakvm_vmm_phys_to_virt(entry));
+            assert((entry & _PAGE_USER) &&
+                   (is_leaf(entry, level) || (entry & _PAGE_RW)));
+            if (is_leaf(entry, level) && (entry & YAKVM_NPT_PINNED)) {
+                yakvm_vmm_teardown_unpin(td,
+                    pfn_to_page(yakvm_vmm_page(entry) >> PAGE_SHIFT));
+            } else if (is_leaf(entry, level) && (entry & YAKVM_NPT_BORROWED)) {
+                /* the page is released with the first leaf of the split */
+            } else if (level == PT) {
+                yakvm_vmm_teardown_free(td, yakvm_vmm_phys_to_virt(entry));
             } else {
-                yakvm_vmm_destroy_table(yakvm_vmm_phys_to_virt(entry),
+                yakvm_vmm_destroy_table(td, yakvm_vmm_phys_to_virt(entry),
                                         level - 1);
             }
         }
     }
-    free_page((unsigned long)table);
+    yakvm_vmm_teardown_free(td, table);
 }
 
 void yakvm_destroy_vmm(struct vmm *vmm)
 {
-    yakvm_vmm_destroy_table(yakvm_vmm_phys_to_virt(vmm->ncr3), PML4T);
-    kfree(vmm);
+    struct teardown td = {};
+
+    yakvm_vmm_destroy_table(&td, yakvm_vmm_phys_to_virt(vmm->ncr3), PML4T);
+    yakvm_vmm_teardown_flush(&td);
+    for (int idx = 0; idx < YAKVM_MAX_MEMORY_SLOTS; ++idx) {
+        kvfree(vmm->slots[idx].dirty_bitmap);
+    }
+    mmdrop(vmm->mm);
+    kmem_cache_free(yakvm_vmm_cache, vmm);
 }
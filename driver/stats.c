@@ -0,0 +1,162 @@
+#include <linux/anon_inodes.h>
+#include <linux/bitops.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/minmax.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include "../include/stats.h"
+#include "../include/vm.h"
+#include "../include/yakvm.h"
+
+#define YAKVM_STATS_DESC(_type, _unit, _stats, _field, _name) { \
+        .type = _type, \
+        .unit = _unit, \
+        .offset = offsetof(_stats, _field), \
+        .size = sizeof(((_stats *)0)->_field) / sizeof(uint64_t), \
+        .name = _name, \
+}
+
+const struct stats_desc yakvm_vm_stats_descs[] = {
+        YAKVM_STATS_DESC(YAKVM_STATS_TYPE_COUNTER, YAKVM_STATS_UNIT_PAGES,
+                         struct vm_stats, npt_pages, "npt_pages"),
+};
+const uint32_t yakvm_vm_stats_num = ARRAY_SIZE(yakvm_vm_stats_descs);
+
+const struct stats_desc yakvm_vcpu_stats_descs[] = {
+        YAKVM_STATS_DESC(YAKVM_STATS_TYPE_COUNTER, YAKVM_STATS_UNIT_NONE,
+                         struct vcpu_stats, exits, "exits"),
+        YAKVM_STATS_DESC(YAKVM_STATS_TYPE_COUNTER, YAKVM_STATS_UNIT_NONE,
+                         struct vcpu_stats, userspace_exits,
+                         "userspace_exits"),
+        YAKVM_STATS_DESC(YAKVM_STATS_TYPE_COUNTER, YAKVM_STATS_UNIT_CYCLES,
+                         struct vcpu_stats, guest_cycles, "guest_cycles"),
+        YAKVM_STATS_DESC(YAKVM_STATS_TYPE_COUNTER, YAKVM_STATS_UNIT_CYCLES,
+                         struct vcpu_stats, host_cycles, "host_cycles"),
+        YAKVM_STATS_DESC(YAKVM_STATS_TYPE_HIST_LOG2, YAKVM_STATS_UNIT_CYCLES,
+                         struct vcpu_stats, exit_latency, "exit_latency"),
+};
+const uint32_t yakvm_vcpu_stats_num = ARRAY_SIZE(yakvm_vcpu_stats_descs);
+
+/*
+ * create the stats, which are allocated by vmalloc_user() to be
+ * mapped into the userspace.
+ */
+struct stats_header *yakvm_create_stats(const struct stats_desc *descs,
+                                        uint32_t num, const char *id)
+{
+        struct stats_header *header;
+        uint32_t desc_offset, data_offset, size = 0;
+
+        for (uint32_t i = 0; i < num; ++i) {
+                size = max(size, descs[i].offset +
+                                 descs[i].size * (uint32_t)sizeof(uint64_t));
+        }
+
+        desc_offset = sizeof(*header);
+        data_offset = ALIGN(desc_offset + num * sizeof(*descs),
+                            sizeof(uint64_t));
+        size += data_offset;
+
+        header = vmalloc_user(size);
+        if (!header) {
+                log(LOG_ERR, "vmalloc_user() failed");
+                return ERR_PTR(-ENOMEM);
+        }
+
+        header->num_desc = num;
+        header->desc_offset = desc_offset;
+        header->data_offset = data_offset;
+        header->size = size;
+        strscpy(header->id, id, sizeof(header->id));
+        memcpy((void *)header + desc_offset, descs, num * sizeof(*descs));
+
+        return header;
+}
+
+void yakvm_destroy_stats(struct stats_header *header)
+{
+        vfree(header);
+}
+
+/* the stats fd holds the vm, so the stats outlive the vm fds */
+struct stats_file {
+        struct vm *vm;
+        struct stats_header *header;
+};
+
+static int yakvm_stats_release(struct inode *inode, struct file *filp)
+{
+        struct stats_file *file = filp->private_data;
+
+        yakvm_put_vm(file->vm);
+        kfree(file);
+        return 0;
+}
+
+static ssize_t yakvm_stats_read(struct file *filp, char __user *buf,
+                                size_t size, loff_t *offset)
+{
+        struct stats_file *file = filp->private_data;
+
+        return simple_read_from_buffer(buf, size, offset, file->header,
+                                       file->header->size);
+}
+
+/* share the stats read-only with the userspace */
+static int yakvm_stats_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+        struct stats_file *file = filp->private_data;
+        int r;
+
+        if (vma->vm_flags & VM_WRITE) {
+                log(LOG_ERR, "yakvm_stats_mmap() map the stats writable");
+                return -EPERM;
+        }
+        vm_flags_clear(vma, VM_MAYWRITE);
+
+        r = remap_vmalloc_range(vma, file->header, vma->vm_pgoff);
+        if (r < 0) {
+                log(LOG_ERR, "remap_vmalloc_range() failed with error "
+                    "code %d", r);
+                return r;
+        }
+
+        return 0;
+}
+
+static const struct file_operations yakvm_stats_fops = {
+        .release = yakvm_stats_release,
+        .read = yakvm_stats_read,
+        .llseek = noop_llseek,
+        .mmap = yakvm_stats_mmap,
+};
+
+int yakvm_stats_getfd(struct vm *vm, struct stats_header *header)
+{
+        struct stats_file *file;
+        int fd;
+
+        file = kmalloc(sizeof(*file), GFP_KERNEL_ACCOUNT);
+        if (!file) {
+                log(LOG_ERR, "kmalloc() failed");
+                return -ENOMEM;
+        }
+
+        file->vm = vm;
+        file->header = header;
+        yakvm_get_vm(vm);
+
+        fd = anon_inode_getfd("kvm-stats", &yakvm_stats_fops, file,
+                              O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                log(LOG_ERR, "anon_inode_getfd() failed "
+                    "with error code %d", fd);
+                yakvm_put_vm(file->vm);
+                kfree(file);
+        }
+
+        return fd;
+}
@@ -1,39 +1,122 @@
 #include <asm/atomic.h>
 #include <linux/anon_inodes.h>
 #include <linux/err.h>
+#include <linux/fadvise.h>
 #include <linux/fdtable.h>
 #include <linux/gfp_types.h>
+#include <linux/minmax.h>
 #include <linux/mm.h>
 #include <linux/mutex.h>
+#include <linux/rcupdate.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
 #include "../include/cpu.h"
+#include "../include/io.h"
+#include "../include/irq.h"
 #include "../include/memory.h"
+#include "../include/stats.h"
+#include "../include/trace.h"
 #include "../include/vm.h"
 #include "../include/yakvm.h"
 
+static struct kmem_cache *yakvm_vm_cache;
+
+int yakvm_create_vm_cache(void)
+{
+        yakvm_vm_cache = KMEM_CACHE(vm, SLAB_ACCOUNT);
+        if (!yakvm_vm_cache) {
+                log(LOG_ERR, "KMEM_CACHE() failed");
+                return -ENOMEM;
+        }
+
+        return 0;
+}
+
+void yakvm_destroy_vm_cache(void)
+{
+        kmem_cache_destroy(yakvm_vm_cache);
+}
+
+/*
+ * the vms are destroyed on the workqueue after their last reference,
+ * so closing the fds of a large vm returns without waiting for its
+ * memory to be freed.
+ */
+static struct workqueue_struct *yakvm_vm_reaper;
+
+int yakvm_create_vm_reaper(void)
+{
+        yakvm_vm_reaper = alloc_workqueue("yakvm-reaper", WQ_UNBOUND, 0);
+        if (!yakvm_vm_reaper) {
+                log(LOG_ERR, "alloc_workqueue() failed");
+                return -ENOMEM;
+        }
+
+        return 0;
+}
+
+/* wait for the pending vms to be destroyed */
+void yakvm_destroy_vm_reaper(void)
+{
+        destroy_workqueue(yakvm_vm_reaper);
+}
+
 /* get the vm */
-static void yakvm_get_vm(struct vm *vm)
+void yakvm_get_vm(struct vm *vm)
 {
         atomic_inc(&vm->refcount);
 }
 
+/*
+ * flush the TLB of all vcpus, which are walked without the vm->lock,
+ * so the *rcu* keeps the vcpu erased meanwhile alive.
+ */
+void yakvm_vm_flush_tlb(struct vm *vm)
+{
+        struct vcpu *vcpu;
+        unsigned long index;
+
+        rcu_read_lock();
+        xa_for_each(&vm->vcpus, index, vcpu) {
+                yakvm_vcpu_flush_tlb(vcpu);
+        }
+        rcu_read_unlock();
+}
+
 /* destroy the vm and relative resources */
 void yakvm_destroy_vm(struct vm *vm)
 {
+        struct vcpu *vcpu;
+        unsigned long index;
+
         log(LOG_INFO, "yakvm_destroy_vm() destroys the kvm %s", vm->id);
+        trace_yakvm_destroy_vm(vm);
+        yakvm_destroy_irqfds(vm);
+        yakvm_destroy_ioeventfds(vm);
+        yakvm_destroy_coalesced(vm->coalesced);
         yakvm_destroy_vmm(vm->vmm);
-        if (vm->vcpu) {
-                yakvm_destroy_vcpu(vm->vcpu);
+        xa_for_each(&vm->vcpus, index, vcpu) {
+                trace_yakvm_destroy_vcpu(vcpu);
+                yakvm_destroy_vcpu(vcpu);
         }
-        kfree(vm);
+        xa_destroy(&vm->vcpus);
+        yakvm_put_iopm(vm->iopm);
+        yakvm_destroy_stats(vm->stats_header);
+        kmem_cache_free(yakvm_vm_cache, vm);
 }
 
-/* put the vm */
+static void yakvm_destroy_vm_work(struct work_struct *work)
+{
+        yakvm_destroy_vm(container_of(work, struct vm, destroy_work));
+}
+
+/* put the vm, which is destroyed by the reaper after the last put */
 void yakvm_put_vm(struct vm *vm)
 {
         if (atomic_dec_and_test(&vm->refcount)) {
-                yakvm_destroy_vm(vm);
+                queue_work(yakvm_vm_reaper, &vm->destroy_work);
         }
 }
 
@@ -44,35 +127,46 @@ static int yakvm_vm_release(struct inode *inode, struct file *filp)
         return 0;
 }
 
-/* create the vcpu and return the vcpu fd */
-static int yakvm_vm_ioctl_create_vcpu(struct vm *vm)
+/* create the vcpu with @id and return the vcpu fd */
+static int yakvm_vm_ioctl_create_vcpu(struct vm *vm, unsigned long id)
 {
         char fdname[YAKVM_MAX_FDNAME];
         struct vcpu *vcpu;
         int fd, r;
 
-        vcpu = yakvm_create_vcpu(vm);
+        if (id >= YAKVM_MAX_VCPUS) {
+                log(LOG_ERR, "vcpu id %lu is out-of-bounds [0, %d)",
+                    id, YAKVM_MAX_VCPUS);
+                return -EINVAL;
+        }
+
+        /* the *iopm* is not replaced before the vcpu is visible */
+        mutex_lock(&vm->lock);
+        vcpu = yakvm_create_vcpu(vm, id);
         if (IS_ERR(vcpu)) {
-                r = PTR_ERR(vm);
+                mutex_unlock(&vm->lock);
+                r = PTR_ERR(vcpu);
                 log(LOG_ERR, "yakvm_create_vcpu() failed "
                     "with error code %d", r);
                 goto out;
         }
 
-        mutex_lock(&vm->lock);
-        if (vm->vcpu) {
-                mutex_unlock(&vm->lock);
+        r = xa_insert(&vm->vcpus, id, vcpu, GFP_KERNEL_ACCOUNT);
+        mutex_unlock(&vm->lock);
+        if (r == -EBUSY) {
                 r = -EEXIST;
                 log(LOG_ERR, "vcpu has been created for kvm %s",
                     vm->id);
                 goto destroy_vcpu;
+        } else if (r) {
+                log(LOG_ERR, "xa_insert() failed with error code %d", r);
+                goto destroy_vcpu;
         }
 
-        vm->vcpu = vcpu;
-        mutex_unlock(&vm->lock);
         yakvm_get_vm(vm);
+        trace_yakvm_create_vcpu(vcpu);
 
-        snprintf(fdname, sizeof (fdname), "kvm-vcpu");
+        snprintf(fdname, sizeof (fdname), "kvm-vcpu:%lu", id);
         fd = anon_inode_getfd(fdname, &yakvm_vcpu_fops, vcpu, O_RDWR);
         if (fd < 0) {
                 r = fd;
@@ -85,9 +179,12 @@ static int yakvm_vm_ioctl_create_vcpu(struct vm *vm)
 
 put_vm:
         mutex_lock(&vm->lock);
-        vm->vcpu = NULL;
+        xa_erase(&vm->vcpus, id);
         mutex_unlock(&vm->lock);
         yakvm_put_vm(vm);
+
+        /* wait for the lockless walkers which may still see the vcpu */
+        synchronize_rcu();
 destroy_vcpu:
         yakvm_destroy_vcpu(vcpu);
 out:
@@ -108,14 +205,165 @@ static int yakvm_vm_ioctl_mmap_page(struct vm *vm, unsigned long gpa)
         return 0;
 }
 
+/* back the guest ram with the userspace memory region */
+static int yakvm_vm_ioctl_set_memory_region(struct vm *vm,
+                                            void * __user src)
+{
+        struct memory_region region;
+        int r;
+
+        r = copy_from_user(&region, src, sizeof(region));
+        if (r) {
+                log(LOG_ERR, "copy_from_user() failed with %d bytes", r);
+                return -EFAULT;
+        }
+
+        return yakvm_vmm_set_region(vm->vmm, &region);
+}
+
+/* fetch and clear the dirty bitmap of the slot */
+static int yakvm_vm_ioctl_get_dirty_log(struct vm *vm, void * __user src)
+{
+        struct dirty_log args;
+        int r;
+
+        r = copy_from_user(&args, src, sizeof(args));
+        if (r) {
+                log(LOG_ERR, "copy_from_user() failed with %d bytes", r);
+                return -EFAULT;
+        }
+
+        return yakvm_vmm_get_dirty_log(vm->vmm, args.slot,
+                                       (void __user *)args.bitmap);
+}
+
+/*
+ * populate the NPT for the gpa ranges, and return the pages mapped by
+ * this call, or the first error, which drops the partial progress.
+ */
+static long yakvm_vm_ioctl_prefault(struct vm *vm, void * __user src)
+{
+        struct prefault_range range;
+        struct prefault args;
+        struct page **pages;
+        long mapped = 0, r;
+
+        r = copy_from_user(&args, src, sizeof(args));
+        if (r) {
+                log(LOG_ERR, "copy_from_user() failed with %ld bytes", r);
+                return -EFAULT;
+        }
+
+        pages = kmalloc_array(PTRS_PER_PAGE, sizeof(*pages), GFP_KERNEL);
+        if (!pages) {
+                log(LOG_ERR, "kmalloc_array() failed");
+                return -ENOMEM;
+        }
+
+        for (uint64_t i = 0; i < args.nr_ranges; ++i) {
+                if (copy_from_user(&range, (void __user *)args.ranges +
+                                   i * sizeof(range), sizeof(range))) {
+                        log(LOG_ERR, "copy_from_user() failed");
+                        r = -EFAULT;
+                        break;
+                }
+
+                r = yakvm_vmm_prefault(vm->vmm, range.gpa, range.size,
+                                       pages);
+                if (r < 0) {
+                        break;
+                }
+                mapped += r;
+        }
+
+        kfree(pages);
+        return r < 0 ? r : mapped;
+}
+
+/* coalesce the guest writes to the zone from userspace into the ring */
+static int yakvm_vm_ioctl_register_coalesced(struct vm *vm,
+                                             void * __user src)
+{
+        struct coalesced_zone zone;
+        int r;
+
+        r = copy_from_user(&zone, src, sizeof(zone));
+        if (r) {
+                log(LOG_ERR, "copy_from_user() failed with %d bytes", r);
+                return -EFAULT;
+        }
+
+        if (zone.type == YAKVM_IO_PIO) {
+                r = yakvm_iopm_intercept(vm, zone.address, zone.size);
+                if (r < 0) {
+                        return r;
+                }
+        }
+
+        r = yakvm_coalesced_register(vm->coalesced, &zone);
+        if (r < 0 || zone.type != YAKVM_IO_MMIO) {
+                return r;
+        }
+
+        /* the guest ram inside the zone must fault to be coalesced */
+        return yakvm_vmm_set_mmio(vm->vmm, zone.address, zone.size);
+}
+
+/* bind the guest write from userspace with the eventfd */
+static int yakvm_vm_ioctl_ioeventfd(struct vm *vm, void * __user src)
+{
+        struct ioeventfd args;
+        int r;
+
+        r = copy_from_user(&args, src, sizeof(args));
+        if (r) {
+                log(LOG_ERR, "copy_from_user() failed with %d bytes", r);
+                return -EFAULT;
+        }
+
+        if ((args.flags & YAKVM_IOEVENTFD_FLAG_PIO) &&
+            !(args.flags & YAKVM_IOEVENTFD_FLAG_DEASSIGN)) {
+                r = yakvm_iopm_intercept(vm, args.address, args.size);
+                if (r < 0) {
+                        return r;
+                }
+        }
+
+        r = yakvm_ioeventfd(vm, &args);
+        if (r < 0 || (args.flags & (YAKVM_IOEVENTFD_FLAG_PIO |
+                                    YAKVM_IOEVENTFD_FLAG_DEASSIGN))) {
+                return r;
+        }
+
+        /* the guest ram at the address must fault to signal the eventfd */
+        return yakvm_vmm_set_mmio(vm->vmm, args.address,
+                                  max_t(uint32_t, args.size, 1));
+}
+
+/* bind the eventfd from userspace with the interrupt vector */
+static int yakvm_vm_ioctl_irqfd(struct vm *vm, void * __user src)
+{
+        struct irqfd args;
+        int r;
+
+        r = copy_from_user(&args, src, sizeof(args));
+        if (r) {
+                log(LOG_ERR, "copy_from_user() failed with %d bytes", r);
+                return -EFAULT;
+        }
+
+        return yakvm_irqfd(vm, &args);
+}
+
 static long yakvm_vm_ioctl(struct file *filp, unsigned int ioctl, unsigned long arg)
 {
         struct vm *vm = filp->private_data;
+        long mapped;
         int r;
 
         switch (ioctl) {
                 case YAKVM_CREATE_VCPU:
-                        r = yakvm_vm_ioctl_create_vcpu(vm);
+                        r = yakvm_vm_ioctl_create_vcpu(vm, arg);
                         if (r < 0) {
                                 log(LOG_ERR,
                                      "yakvm_dev_ioctl_create_vm() "
@@ -132,6 +380,71 @@ static long yakvm_vm_ioctl(struct file *filp, unsigned int ioctl, unsigned long
                         }
                         return r;
 
+                case YAKVM_SET_MEMORY_REGION:
+                        r = yakvm_vm_ioctl_set_memory_region(vm,
+                                                             (void *)arg);
+                        if (r < 0) {
+                                log(LOG_ERR,
+                                    "yakvm_vm_ioctl_set_memory_region() "
+                                    "failed with error code %d", r);
+                        }
+                        return r;
+
+                case YAKVM_PREFAULT:
+                        mapped = yakvm_vm_ioctl_prefault(vm, (void *)arg);
+                        if (mapped < 0) {
+                                log(LOG_ERR,
+                                    "yakvm_vm_ioctl_prefault() "
+                                    "failed with error code %ld", mapped);
+                        }
+                        return mapped;
+
+                case YAKVM_GET_DIRTY_LOG:
+                        r = yakvm_vm_ioctl_get_dirty_log(vm, (void *)arg);
+                        if (r < 0) {
+                                log(LOG_ERR,
+                                    "yakvm_vm_ioctl_get_dirty_log() "
+                                    "failed with error code %d", r);
+                        }
+                        return r;
+
+                case YAKVM_REGISTER_COALESCED:
+                        r = yakvm_vm_ioctl_register_coalesced(vm,
+                                                              (void *)arg);
+                        if (r < 0) {
+                                log(LOG_ERR,
+                                    "yakvm_vm_ioctl_register_coalesced() "
+                                    "failed with error code %d", r);
+                        }
+                        return r;
+
+                case YAKVM_IOEVENTFD:
+                        r = yakvm_vm_ioctl_ioeventfd(vm, (void *)arg);
+                        if (r < 0) {
+                                log(LOG_ERR,
+                                    "yakvm_vm_ioctl_ioeventfd() "
+                                    "failed with error code %d", r);
+                        }
+                        return r;
+
+                case YAKVM_IRQFD:
+                        r = yakvm_vm_ioctl_irqfd(vm, (void *)arg);
+                        if (r < 0) {
+                                log(LOG_ERR,
+                                    "yakvm_vm_ioctl_irqfd() "
+                                    "failed with error code %d", r);
+                        }
+                        return r;
+
+                case YAKVM_GET_STATS_FD:
+                        r = yakvm_stats_getfd(vm, vm->stats_header);
+                        if (r < 0) {
+                                log(LOG_ERR,
+                                    "yakvm_stats_getfd() "
+                                    "failed with error code %d", r);
+                        }
+                        return r;
+
                 default:
                         log(LOG_ERR, "yakvm_vm_ioctl() get unknown ioctl %d",
                             ioctl);
@@ -141,20 +454,100 @@ static long yakvm_vm_ioctl(struct file *filp, unsigned int ioctl, unsigned long
         return 0;
 }
 
-/* map the vm physical memory to host physical memory */
+/*
+ * map the vm physical memory to host physical memory. The host
+ * touching the guest memory through the vm fd, e.g. reading a large
+ * buffer, maps the populated pages around the fault at once, so it
+ * takes one fault per *YAKVM_FAULT_AROUND* pages once the guest or
+ * the prefault has touched them. The untouched pages are left to
+ * their own faults, so the fault never populates more than it is
+ * asked for.
+ */
+#define YAKVM_FAULT_AROUND      16
+
+/* insert the @nr @pages from @addr, skipping the pages mapped already */
+static void yakvm_vm_insert_pages(struct vm_area_struct *vma,
+                                  unsigned long addr, struct page **pages,
+                                  unsigned long nr)
+{
+        unsigned long left;
+        int r;
+
+        while (nr) {
+                left = nr;
+                r = vm_insert_pages(vma, addr, pages, &left);
+                if (r != -EBUSY) {
+                        break;
+                }
+
+                /* the failed page is mapped by the racing fault */
+                left -= 1;
+                addr += (nr - left) << PAGE_SHIFT;
+                pages += nr - left;
+                nr = left;
+        }
+}
+
+static void yakvm_vm_vmm_fault_around(struct vm *vm, struct vm_fault *vmf)
+{
+        struct vm_area_struct *vma = vmf->vma;
+        struct page *pages[YAKVM_FAULT_AROUND];
+        unsigned long start, end, addr, gpa;
+        unsigned long nr = 0, leaf;
+        entry *pte;
+        int level;
+
+        start = ALIGN_DOWN(vmf->address, YAKVM_FAULT_AROUND * PAGE_SIZE);
+        end = min(start + YAKVM_FAULT_AROUND * PAGE_SIZE, vma->vm_end);
+        start = max(start, vma->vm_start);
+
+        for (addr = start; addr < end; addr += PAGE_SIZE) {
+                gpa = (vma->vm_pgoff << PAGE_SHIFT) + addr - vma->vm_start;
+                pte = addr == vmf->address ? NULL :
+                      yakvm_vmm_npt_lookup(vm->vmm, gpa, &level);
+                leaf = pte ? READ_ONCE(*pte) : 0;
+
+                /* only the populated kernel pages, never the slots */
+                if ((leaf & _PAGE_PRESENT) &&
+                    !(leaf & (YAKVM_NPT_PINNED | YAKVM_NPT_BORROWED))) {
+                        pages[nr++] = pfn_to_page((yakvm_vmm_page(leaf) +
+                                (gpa & (level_size(level) - 1))) >> PAGE_SHIFT);
+                        continue;
+                }
+
+                /* the faulting page and the holes end the batch */
+                yakvm_vm_insert_pages(vma, addr - (nr << PAGE_SHIFT),
+                                      pages, nr);
+                nr = 0;
+        }
+        yakvm_vm_insert_pages(vma, end - (nr << PAGE_SHIFT), pages, nr);
+}
+
 static vm_fault_t yakvm_vm_vmm_fault(struct vm_fault *vmf)
 {
         int r;
         struct vm *vm = vmf->vma->vm_file->private_data;
-        struct page *page = yakvm_vmm_npt_create(vm->vmm,
-                                vmf->address - vmf->vma->vm_start, false);
+        struct page *page = yakvm_vmm_host_page(vm->vmm,
+                                                vmf->pgoff << PAGE_SHIFT);
+
+        /*
+         * the slots are mapped by the userspace itself, whose pages
+         * can neither be pinned under the *mmap_lock* held by the
+         * fault nor be mapped into the vm fd, and the mmio has no
+         * page at all.
+         */
+        if (!page) {
+                return VM_FAULT_SIGBUS;
+        }
         if (IS_ERR(page)) {
                 r = PTR_ERR(page);
-                log(LOG_ERR, "yakvm_vmm_npt_create() "
+                log(LOG_ERR, "yakvm_vmm_host_page() "
                     "failed with error code %d", r);
-                return r;
+                return vmf_error(r);
         }
 
+        yakvm_vm_vmm_fault_around(vm, vmf);
+
         get_page(page);
         vmf->page = page;
         return 0;
@@ -164,14 +557,85 @@ static const struct vm_operations_struct yakvm_vm_vmm_ops = {
         .fault = yakvm_vm_vmm_fault,
 };
 
-/* expose vm physical memory to userspace */
+/* share the coalesced ring with kernel and userspace */
+static int yakvm_vm_coalesced_mmap(struct vm *vm,
+                                   struct vm_area_struct *vma)
+{
+        int r;
+
+        if (vma->vm_end - vma->vm_start != PAGE_SIZE) {
+                log(LOG_ERR, "yakvm_vm_coalesced_mmap() map %ld bytes "
+                    "instead of page size", vma->vm_end - vma->vm_start);
+                return -EINVAL;
+        }
+
+        r = remap_pfn_range(vma, vma->vm_start,
+                            virt_to_phys(vm->coalesced->ring) >> PAGE_SHIFT,
+                            PAGE_SIZE, vma->vm_page_prot);
+        if (r < 0) {
+                log(LOG_ERR, "remap_pfn_range() failed with error code %d",
+                    r);
+                return r;
+        }
+
+        return 0;
+}
+
+/* expose vm physical memory or coalesced ring to userspace */
 static int yakvm_vm_mmap(struct file *filp,
                          struct vm_area_struct *vma)
 {
+        struct vm *vm = filp->private_data;
+
+        if (vma->vm_pgoff == YAKVM_COALESCED_RING_OFFSET >> PAGE_SHIFT) {
+                return yakvm_vm_coalesced_mmap(vm, vma);
+        }
+
+        /* vm_insert_pages() needs it set with the *mmap_lock* held */
+        vm_flags_set(vma, VM_MIXEDMAP);
         vma->vm_ops = &yakvm_vm_vmm_ops;
         return 0;
 }
 
+/*
+ * *madvise(MADV_WILLNEED)* on the mmap() of the vm fd populates the
+ * NPT for the range in advance, as *YAKVM_PREFAULT*, so the guest
+ * never faults on it later. No pte is installed, so the host still
+ * faults, which then maps the populated pages around it in one batch.
+ * The other advices are not supported.
+ */
+static int yakvm_vm_fadvise(struct file *filp, loff_t offset, loff_t len,
+                            int advice)
+{
+        struct vm *vm = filp->private_data;
+        struct page **pages;
+        long r;
+
+        if (advice != POSIX_FADV_WILLNEED) {
+                return -EINVAL;
+        }
+
+        if (offset < 0) {
+                return -EINVAL;
+        }
+
+        /* the whole guest memory from @offset */
+        if (!len) {
+                len = max_t(loff_t, vm->vmm->memory - offset, 0);
+        }
+
+        pages = kmalloc_array(PTRS_PER_PAGE, sizeof(*pages), GFP_KERNEL);
+        if (!pages) {
+                log(LOG_ERR, "kmalloc_array() failed");
+                return -ENOMEM;
+        }
+
+        r = yakvm_vmm_prefault(vm->vmm, offset, len, pages);
+        kfree(pages);
+
+        return r < 0 ? r : 0;
+}
+
 /*
  * interface for userspace-kvm interaction, describe how the
  * userspace emulator can manipulate the virtual machine
@@ -180,41 +644,76 @@ const struct file_operations yakvm_vm_fops = {
         .release = yakvm_vm_release,
         .unlocked_ioctl = yakvm_vm_ioctl,
         .mmap = yakvm_vm_mmap,
+        .fadvise = yakvm_vm_fadvise,
 };
 
 /* create the vm */
 struct vm * yakvm_create_vm(void)
 {
+        struct stats_header *stats;
+        struct coalesced *coalesced;
         struct vm *vm;
         struct vmm *vmm;
         int r;
 
-        vm = kmalloc(sizeof(struct vm), GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+        vm = kmem_cache_zalloc(yakvm_vm_cache, GFP_KERNEL_ACCOUNT);
         if (!vm) {
-                log(LOG_ERR, "kmalloc() failed");
+                log(LOG_ERR, "kmem_cache_zalloc() failed");
                 r = -ENOMEM;
                 goto out;
         }
+        snprintf(vm->id, sizeof(vm->id), "kvm-%d", task_pid_nr(current));
+
+        /* the vmm counts the populated pages into the stats */
+        stats = yakvm_create_stats(yakvm_vm_stats_descs,
+                                   yakvm_vm_stats_num, vm->id);
+        if (IS_ERR(stats)) {
+                r = PTR_ERR(stats);
+                log(LOG_ERR, "yakvm_create_stats() failed with error code "
+                    "%d", r);
+                goto free_vm;
+        }
+        vm->stats_header = stats;
+        vm->stats = yakvm_stats_data(stats);
 
         vmm = yakvm_create_vmm(vm);
         if (IS_ERR(vmm)) {
                 r = PTR_ERR(vmm);
                 log(LOG_ERR, "yakvm_create_vmm() failed with error code "
                     "%d", r);
-                goto free_vm;
+                goto destroy_stats;
+        }
+
+        coalesced = yakvm_create_coalesced();
+        if (IS_ERR(coalesced)) {
+                r = PTR_ERR(coalesced);
+                log(LOG_ERR, "yakvm_create_coalesced() failed with error "
+                    "code %d", r);
+                goto destroy_vmm;
         }
 
         /* initialize the *vm* */
         mutex_init(&vm->lock);
         atomic_set(&vm->refcount, 1);
-        snprintf(vm->id, sizeof(vm->id), "kvm-%d", task_pid_nr(current));
+        INIT_WORK(&vm->destroy_work, yakvm_destroy_vm_work);
+        spin_lock_init(&vm->ioeventfds_lock);
+        INIT_LIST_HEAD(&vm->ioeventfds);
+        INIT_LIST_HEAD(&vm->irqfds);
+        xa_init(&vm->vcpus);
         vm->vmm = vmm;
+        vm->coalesced = coalesced;
+        vm->iopm = yakvm_get_default_iopm();
 
         log(LOG_INFO, "yakvm_create_vm() creates the kvm %s", vm->id);
+        trace_yakvm_create_vm(vm);
         return vm;
 
+destroy_vmm:
+        yakvm_destroy_vmm(vmm);
+destroy_stats:
+        yakvm_destroy_stats(stats);
 free_vm:
-        kfree(vm);
+        kmem_cache_free(yakvm_vm_cache, vm);
 out:
         return ERR_PTR(r);
 }
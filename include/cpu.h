@@ -4,18 +4,9 @@
 
         /* for userspace and kernel to share vcpu state data */
         #ifndef __KERNEL__
+                #include <stdbool.h>
                 #include <stdint.h>
         #endif // __KERNEL__
-        struct state {
-                uint32_t exit_code;              // vmcb->control.exit_code
-                uint64_t exit_info_1;            // vmcb->control.exit_info_1
-                uint64_t exit_info_2;            // vmcb->control.exit_info_2
-
-                /* used for #DB */
-                uint64_t cs;
-                uint64_t rip;
-        };
-
         struct registers {
                 uint64_t rax;
                 uint64_t rbx;
@@ -38,6 +29,111 @@
                 uint16_t ss;
         };
 
+        /* PIO/MMIO request decoded by the kernel */
+        #define YAKVM_IO_PIO            0
+        #define YAKVM_IO_MMIO           1
+        #define YAKVM_IO_OUT            0
+        #define YAKVM_IO_IN             1
+        struct io {
+                uint8_t type;                    // YAKVM_IO_PIO or YAKVM_IO_MMIO
+                uint8_t direction;               // YAKVM_IO_OUT or YAKVM_IO_IN
+                uint8_t size;                    // access size in bytes
+                uint64_t address;                // port or gpa
+                uint64_t data;                   // value written or to be read
+        };
+
+        /* *state.regs* modified by userspace, synced on next *YAKVM_RUN* */
+        #define YAKVM_DIRTY_REGS        (1u << 0)
+
+        struct state {
+                uint32_t exit_code;              // vmcb->control.exit_code
+                uint64_t exit_info_1;            // vmcb->control.exit_info_1
+                uint64_t exit_info_2;            // vmcb->control.exit_info_2
+
+                /* used for #DB */
+                uint64_t cs;
+                uint64_t rip;
+
+                /*
+                 * registers when returning to userspace, the rip already
+                 * points to the next instruction for PIO/MMIO exits.
+                 */
+                struct registers regs;
+                uint32_t dirty;                  // YAKVM_DIRTY_* flags
+
+                /*
+                 * used for *SVM_EXIT_IOIO* and mmio *SVM_EXIT_NPF*,
+                 * *io.data* for *YAKVM_IO_IN* should be filled by
+                 * userspace before next *YAKVM_RUN*.
+                 */
+                struct io io;
+        };
+
+        /*
+         * trace record of the vcpu exits, including the single-step
+         * *#DB* for each instruction, when the tracing is enabled
+         * by *YAKVM_TRACE*.
+         */
+        struct trace_entry {
+                uint64_t tsc;                    // tsc at the exit
+                uint64_t cs;                     // cs base at the exit
+                uint64_t rip;                    // rip at the exit
+                uint32_t exit_code;              // vmcb->control.exit_code
+                uint8_t insn_len;                // valid bytes in *insn*
+                uint8_t insn[15];                // opcode bytes at cs:rip
+        };
+
+        /*
+         * ring shared with the userspace, where the kernel appends
+         * entries at *last* and the userspace consumes them from
+         * *first*.
+         */
+        struct trace_ring {
+                uint32_t first;
+                uint32_t last;
+                struct trace_entry entries[];
+        };
+        #define YAKVM_TRACE_RING_SIZE   (16 * 4096)
+        #define YAKVM_TRACE_RING_MAX \
+                ((YAKVM_TRACE_RING_SIZE - sizeof(struct trace_ring)) / \
+                 sizeof(struct trace_entry))
+
+        /* offset of the trace ring in the vcpu fd mmap space */
+        #define YAKVM_TRACE_RING_OFFSET 4096
+
+        /*
+         * I/O intercept information is described
+         * at "15.10.2" on page 516 at
+         * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+         */
+        #define SVM_IOIO_TYPE_OUT       0
+        #define SVM_IOIO_TYPE_IN        1
+        #define SVM_IOIO_TYPE_MASK      1
+        #define SVM_IOIO_TYPE_SHIFT     0
+        static inline uint8_t svm_ioio_type(uint32_t info)
+        {
+                return (info >> SVM_IOIO_TYPE_SHIFT) & SVM_IOIO_TYPE_MASK;
+        }
+        #define SVM_IOIO_SZ8_MASK       1
+        #define SVM_IOIO_SZ8_SHIFT      4
+        static inline bool svm_ioio_is_size8(uint32_t info)
+        {
+                return (info >> SVM_IOIO_SZ8_SHIFT) & SVM_IOIO_SZ8_MASK;
+        }
+        /* SZ8, SZ16 and SZ32 bits are one-hot, so they encode the size */
+        #define SVM_IOIO_SIZE_MASK      7
+        #define SVM_IOIO_SIZE_SHIFT     SVM_IOIO_SZ8_SHIFT
+        static inline uint8_t svm_ioio_size(uint32_t info)
+        {
+                return (info >> SVM_IOIO_SIZE_SHIFT) & SVM_IOIO_SIZE_MASK;
+        }
+        #define SVM_IOIO_PORT_MASK      ((1ul << 16) - 1)
+        #define SVM_IOIO_PORT_SHIFT     16
+        static inline uint16_t svm_ioio_port(uint32_t info)
+        {
+                return (info >> SVM_IOIO_PORT_SHIFT) & SVM_IOIO_PORT_MASK;
+        }
+
         #ifdef __KERNEL__
 
                 /*
@@ -158,6 +254,66 @@
 
                 #define SVM_NESTED_CTL_NP_ENABLE	BIT(0)
 
+                /*
+                 * virtual interrupt control fields in *int_ctl* according
+                 * to "15.21.1" on page 532 at
+                 * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+                 */
+                #define V_IRQ_SHIFT                     8
+                #define V_IRQ_MASK                      (1 << V_IRQ_SHIFT)
+                #define V_INTR_PRIO_SHIFT               16
+                #define V_INTR_PRIO_MASK                (0x0f << V_INTR_PRIO_SHIFT)
+                #define V_IGN_TPR_SHIFT                 20
+                #define V_IGN_TPR_MASK                  (1 << V_IGN_TPR_SHIFT)
+                #define V_INTR_MASKING_SHIFT            24
+                #define V_INTR_MASKING_MASK             (1 << V_INTR_MASKING_SHIFT)
+
+                #define SVM_INTERRUPT_SHADOW_MASK       BIT_ULL(0)
+
+                /*
+                 * event injection fields in *event_inj* and *exit_int_info*
+                 * according to "15.20" on page 530 at
+                 * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+                 */
+                #define SVM_EVTINJ_VEC_MASK             0xff
+                #define SVM_EVTINJ_TYPE_SHIFT           8
+                #define SVM_EVTINJ_TYPE_INTR            (0 << SVM_EVTINJ_TYPE_SHIFT)
+                #define SVM_EVTINJ_VALID                (1 << 31)
+                #define SVM_EXITINTINFO_VALID           SVM_EVTINJ_VALID
+
+                /*
+                 * VMCB clean bits, a set bit tells the processor that
+                 * the corresponding area is unchanged since the last
+                 * *vmrun* of this *vmcb* on this physical cpu, and can
+                 * be served from its cache according to "15.15" at
+                 * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+                 */
+                enum {
+                        VMCB_INTERCEPTS = 0,    /* intercepts, tsc offset, pause filter */
+                        VMCB_PERM_MAP,          /* iopm and msrpm base */
+                        VMCB_ASID,
+                        VMCB_INTR,              /* int_ctl, int_vector */
+                        VMCB_NPT,               /* nested_ctl, nested_cr3, g_pat */
+                        VMCB_CR,                /* cr0, cr3, cr4, efer */
+                        VMCB_DR,                /* dr6, dr7 */
+                        VMCB_DT,                /* gdtr, idtr */
+                        VMCB_SEG,               /* cs, ds, ss, es, cpl */
+                        VMCB_CR2,
+                        VMCB_LBR,
+                        VMCB_AVIC,
+                        VMCB_DIRTY_MAX,
+                };
+                #define VMCB_ALL_CLEAN_MASK     ((1U << VMCB_DIRTY_MAX) - 1)
+
+                /*
+                 * *tlb_ctl* values to flush the TLB on *vmrun* according
+                 * to "15.16.1" at
+                 * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+                 */
+                #define TLB_CONTROL_DO_NOTHING          0
+                #define TLB_CONTROL_FLUSH_ALL_ASID      1
+                #define TLB_CONTROL_FLUSH_ASID          3
+
                 struct __attribute__ ((__packed__)) vmcb_control_area {
                         uint32_t intercepts[MAX_INTERCEPT];
                         uint32_t reserved_1[15 - MAX_INTERCEPT];
@@ -313,9 +469,15 @@
                 #include <asm/page_types.h>
                 static_assert(PAGE_SIZE == 4096);
                 static_assert(sizeof(struct vmcb) <= PAGE_SIZE);
+                static_assert(sizeof(struct state) <= PAGE_SIZE);
 
                 #include <linux/mutex.h>
+                #include <linux/percpu.h>
+                #include <linux/preempt.h>
+                #include <linux/types.h>
+                #include <linux/wait.h>
                 #include "vm.h"
+                #define YAKVM_NR_VECTORS        256
                 struct context {
                         struct vmcb *vmcb;
                         uint64_t rbx;
@@ -369,14 +531,75 @@
                         struct mutex lock;
                         struct context gctx;
                         struct context hctx;
-                        void *hsave;
-                        void *iopm;
+                        struct preempt_notifier pn;
+                        int cpu;                        /* last physical cpu */
+                        bool in_guest;                  /* between *clgi* and *stgi* */
+                        uint64_t asid_generation;
                         struct state *state;
+                        bool io_pending;        /* waiting for *io.data* */
+                        uint8_t io_size;        /* decoded, *io.size* is untrusted */
+                        uint8_t io_direction;   /* decoded, *io.direction* is untrusted */
+                        DECLARE_BITMAP(irqs, YAKVM_NR_VECTORS);
+                        unsigned long requests;         /* YAKVM_REQ_* */
+                        bool trace;
+                        struct trace_ring *trace_ring;
+                        uint32_t trace_last;    /* producer, *trace_ring->last* is untrusted */
+                        bool halt;                      /* handle *HLT* in kernel */
+                        bool halted;                    /* blocked by *HLT* */
+                        unsigned int halt_poll_ns;      /* adaptive polling window */
+                        wait_queue_head_t wq;           /* woken for interrupts */
+                        struct stats_header *stats_header;
+                        struct vcpu_stats *stats;
+                        uint64_t exit_tsc;              /* tsc of the last *vmexit* */
                         struct vm *vm;
+                        unsigned int id;
+                };
+
+                /*
+                 * per physical cpu host state, *saved* records whether
+                 * *vmcb* holds the host state of the current thread,
+                 * *current_vmcb* is the guest *vmcb* last run on the
+                 * physical cpu, whose clean bits are valid only here.
+                 */
+                struct host {
+                        void *hsave;
+                        struct vmcb *vmcb;
+                        bool saved;
+                        struct vmcb *current_vmcb;
+
+                        /*
+                         * ASIDs are handed out from *next_asid* on each
+                         * physical cpu, once they run out, the TLB is
+                         * flushed and a new *asid_generation* starts,
+                         * which invalidates all ASIDs handed out before.
+                         */
+                        uint64_t asid_generation;
+                        uint32_t next_asid;
+                        uint32_t max_asid;
                 };
+                DECLARE_PER_CPU(struct host, yakvm_host);
+
+                /* allocate and free the per physical cpu host state */
+                int yakvm_create_hosts(void);
+                void yakvm_destroy_hosts(void);
+
+                /* allocate and free the pool of the vcpu bundles */
+                int yakvm_create_vcpu_pool(void);
+                void yakvm_destroy_vcpu_pool(void);
+
+                /* queue the external interrupt @vector for the vcpu */
+                void yakvm_vcpu_interrupt(struct vcpu *vcpu, uint8_t vector);
+
+                /* flush the TLB of the vcpu before it runs the guest again */
+                #define YAKVM_REQ_TLB_FLUSH     0
+                void yakvm_vcpu_flush_tlb(struct vcpu *vcpu);
+
+                /* switch to the *iopm* of the vm before running again */
+                #define YAKVM_REQ_IOPM_RELOAD   1
+                void yakvm_vcpu_reload_iopm(struct vcpu *vcpu);
 
                 /* create the vcpu */
-                struct vcpu* yakvm_create_vcpu(struct vm *vm);
+                struct vcpu* yakvm_create_vcpu(struct vm *vm, unsigned int id);
 
                 /* destory the vcpu */
                 void yakvm_destroy_vcpu(struct vcpu *vcpu);
@@ -396,6 +619,9 @@
         #define YAKVM_RUN               _IO(YAKVMIO,   0x20)
         #define YAKVM_GET_REGS          _IO(YAKVMIO,   0x21)
         #define YAKVM_SET_REGS          _IO(YAKVMIO,   0x22)
+        #define YAKVM_INTERRUPT         _IO(YAKVMIO,   0x23) /* queue the vector */
+        #define YAKVM_TRACE             _IO(YAKVMIO,   0x24) /* enable the tracing */
+        #define YAKVM_HALT              _IO(YAKVMIO,   0x25) /* handle HLT in kernel */
 
         /*
          * *vmexit* exit code according to "Appendix C" on page 745 at
@@ -518,4 +744,12 @@
         #define SVM_EXIT_VMGEXIT                        0x403
         #define SVM_EXIT_INVALID                        -1
 
+        /*
+         * exit code defined by yakvm instead of the *vmexit*, which
+         * indicates that the vcpu returns to the userspace without
+         * any exit to be handled, e.g. for pending signals, where
+         * *YAKVM_RUN* fails with *EINTR*.
+         */
+        #define YAKVM_EXIT_INTR                         0x10000
+
 #endif // __YAKVM_CPU_H_
@@ -0,0 +1,101 @@
+#ifndef __YAKVM_IO_H_
+
+        #define __YAKVM_IO_H_
+
+        /* for userspace and kernel to share coalesced PIO/MMIO writes */
+        #ifndef __KERNEL__
+                #include <stdint.h>
+        #endif // __KERNEL__
+
+        /* PIO/MMIO range whose writes are appended to the ring */
+        struct coalesced_zone {
+                uint64_t address;                // port or gpa
+                uint32_t size;                   // size in bytes
+                uint32_t type;                   // YAKVM_IO_PIO or YAKVM_IO_MMIO
+        };
+
+        struct coalesced_entry {
+                uint64_t address;                // port or gpa
+                uint64_t data;                   // value written
+                uint8_t type;                    // YAKVM_IO_PIO or YAKVM_IO_MMIO
+                uint8_t size;                    // access size in bytes
+        };
+
+        /*
+         * single page ring shared by the vcpus of a vm, where the
+         * kernel appends entries at *last* and the userspace
+         * consumes them from *first*.
+         */
+        struct coalesced_ring {
+                uint32_t first;
+                uint32_t last;
+                struct coalesced_entry entries[];
+        };
+        #define YAKVM_COALESCED_RING_MAX \
+                ((4096 - sizeof(struct coalesced_ring)) / \
+                 sizeof(struct coalesced_entry))
+
+        /* offset of the ring in the vm fd mmap space, beyond guest memory */
+        #define YAKVM_COALESCED_RING_OFFSET     (1ul << 40)
+
+        /*
+         * guest PIO/MMIO writes signaling the eventfd inside the
+         * kernel instead of exiting to the userspace.
+         */
+        #define YAKVM_IOEVENTFD_FLAG_PIO        (1u << 0)
+        #define YAKVM_IOEVENTFD_FLAG_DATAMATCH  (1u << 1)
+        #define YAKVM_IOEVENTFD_FLAG_DEASSIGN   (1u << 2)
+        struct ioeventfd {
+                uint64_t address;                // port or gpa
+                uint64_t datamatch;              // valid with FLAG_DATAMATCH
+                uint32_t size;                   // access size, 0 for any
+                int32_t fd;                      // eventfd to be signaled
+                uint32_t flags;                  // YAKVM_IOEVENTFD_FLAG_*
+        };
+
+        #ifdef __KERNEL__
+                #include <linux/spinlock.h>
+                #include "cpu.h"
+
+                #define YAKVM_COALESCED_MAX_ZONES       16
+                struct coalesced {
+                        spinlock_t lock;
+                        struct coalesced_ring *ring;
+                        uint32_t last;          /* producer, *ring->last* is untrusted */
+                        uint32_t nzones;
+                        struct coalesced_zone zones[YAKVM_COALESCED_MAX_ZONES];
+                };
+
+                struct coalesced *yakvm_create_coalesced(void);
+                void yakvm_destroy_coalesced(struct coalesced *coalesced);
+                int yakvm_coalesced_register(struct coalesced *coalesced,
+                                             const struct coalesced_zone *zone);
+
+                int yakvm_ioeventfd(struct vm *vm,
+                                    const struct ioeventfd *args);
+                void yakvm_destroy_ioeventfds(struct vm *vm);
+
+                /* handle the guest PIO/MMIO write inside the kernel */
+                bool yakvm_io_write(struct vm *vm, const struct io *io);
+
+                /*
+                 * I/O Permissions Map(iopm) shared by all vcpus of the
+                 * vms with the same intercepted ports. The vms share the
+                 * default one, which intercepts *YAKVM_PIO_HAWK* only,
+                 * until the vm registers any other port.
+                 */
+                #include <linux/refcount.h>
+                struct iopm {
+                        refcount_t refcount;
+                        void *bitmap;
+                };
+
+                int yakvm_create_default_iopm(void);
+                void yakvm_destroy_default_iopm(void);
+                struct iopm *yakvm_get_default_iopm(void);
+                void yakvm_put_iopm(struct iopm *iopm);
+                int yakvm_iopm_intercept(struct vm *vm, uint64_t port,
+                                         uint32_t size);
+        #endif // __KERNEL__
+
+#endif // __YAKVM_IO_H_
@@ -0,0 +1,25 @@
+#ifndef __YAKVM_IRQ_H_
+
+        #define __YAKVM_IRQ_H_
+
+        /* for userspace and kernel to share irqfd data */
+        #ifndef __KERNEL__
+                #include <stdint.h>
+        #endif // __KERNEL__
+
+        /* writing the eventfd injects the @vector into the vcpu @vcpu */
+        #define YAKVM_IRQFD_FLAG_DEASSIGN       (1u << 0)
+        struct irqfd {
+                int32_t fd;                      // eventfd to be polled
+                uint32_t vector;                 // external interrupt vector
+                uint32_t flags;                  // YAKVM_IRQFD_FLAG_*
+                uint32_t vcpu;                   // id of the created vcpu
+        };
+
+        #ifdef __KERNEL__
+                struct vm;
+                int yakvm_irqfd(struct vm *vm, const struct irqfd *args);
+                void yakvm_destroy_irqfds(struct vm *vm);
+        #endif // __KERNEL__
+
+#endif // __YAKVM_IRQ_H_
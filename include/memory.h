@@ -5,18 +5,91 @@
     #define KiB * (1024)
 
     #include "yakvm.h"
+
+    /*
+     * guest ram region backed by the userspace memory at @uaddr, e.g.
+     * the anonymous, memfd or hugetlbfs mapping, which is registered
+     * by *YAKVM_SET_MEMORY_REGION* and mapped into the guest at @gpa.
+     *
+     * The @gpa, @size and @uaddr must be page aligned, and the region
+     * in a slot can not be changed once registered.
+     *
+     * The region shadows the kernel ram below *YAKVM_MEMORY* it
+     * covers, which is then neither mapped into the guest nor exposed
+     * by mmap() on the vm fd, so it must be registered before that
+     * ram is populated, e.g. by the guest or *YAKVM_PREFAULT*.
+     *
+     * The guest writes to the region with *YAKVM_MEM_LOG_DIRTY_PAGES*
+     * are logged into the dirty bitmap, which is fetched and cleared by
+     * *YAKVM_GET_DIRTY_LOG*. Such region is always mapped by 4K pages.
+     */
+    #ifndef __KERNEL__
+        #include <stdint.h>
+    #endif // __KERNEL__
+    #define YAKVM_MAX_MEMORY_SLOTS  32
+    #define YAKVM_MEM_LOG_DIRTY_PAGES       (1u << 0)
+    struct memory_region {
+        uint32_t slot;
+        uint32_t flags;         // YAKVM_MEM_*
+        uint64_t gpa;
+        uint64_t size;
+        uint64_t uaddr;
+    };
+
+    /*
+     * fetch and clear the dirty bitmap of the @slot into @bitmap, which
+     * holds one bit per 4K page of the slot, rounded up to 64 bits.
+     */
+    struct dirty_log {
+        uint32_t slot;
+        uint32_t padding;
+        uint64_t bitmap;        // uint64_t *
+    };
+
+    /*
+     * populate the NPT for @nr_ranges ranges at the userspace pointer
+     * @ranges by *YAKVM_PREFAULT*, which returns the number of 4K
+     * pages mapped in the ranges by this call, or the first error.
+     * The mmio, holes and populated pages are skipped.
+     */
+    struct prefault_range {
+        uint64_t gpa;
+        uint64_t size;
+    };
+    struct prefault {
+        uint64_t nr_ranges;
+        uint64_t ranges;        // struct prefault_range *
+    };
+
     #ifdef __KERNEL__
 
         #include <asm/page_types.h>
+        #include <asm/pgtable_types.h>
         #define PTRS_PER_PAGE       (PAGE_SIZE / sizeof(unsigned long))
         typedef unsigned long entry;
         struct table {
             entry entrys[PTRS_PER_PAGE];
         };
 
+        /* the registered region, which is empty if @npages is 0 */
+        struct memory_slot {
+            unsigned long gpa;
+            unsigned long npages;
+            unsigned long uaddr;
+            unsigned long *dirty_bitmap;    /* NULL if not logged */
+        };
+
+        #include <linux/atomic.h>
+        #include <linux/mm_types.h>
+        #include <linux/mutex.h>
         struct vmm {
+            struct mutex lock;      /* serialize the slot registration */
             unsigned long ncr3;
+            unsigned long memory;   /* size of the guest ram */
+            struct memory_slot slots[YAKVM_MAX_MEMORY_SLOTS];
+            struct mm_struct *mm;   /* owns the userspace of the slots */
             struct vm *vm;
+            atomic64_t npt_pages;   /* published to *vm->stats* */
         };
 
         /*
@@ -48,6 +121,43 @@
             assert(false);
         }
 
+        /*
+         * size mapped by an entry at @level, where the *PDT* and *PDPT*
+         * entries with the *_PAGE_PSE* bit map the 2MB and 1GB pages
+         * directly according to "5.3.4" on page 147 at
+         * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf.
+         */
+        static inline unsigned long level_size(uint32_t level)
+        {
+            return 1ul << (P_SHIFT + (level - PT) * 9);
+        }
+
+        /* check whether the @entry at @level maps the page directly */
+        static inline bool is_leaf(unsigned long entry, uint32_t level)
+        {
+            return level == PT || (entry & _PAGE_PSE);
+        }
+
+        /*
+         * the leaf maps a page pinned from the slots instead of the page
+         * allocated by the kernel, which uses the bits available to the
+         * software in "5.4.1" on page 153 at
+         * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf.
+         */
+        #define YAKVM_NPT_PINNED    _PAGE_SOFTW1
+        /*
+         * the leaf split from a huge leaf, whose page is kept by the
+         * first leaf of the same split.
+         */
+        #define YAKVM_NPT_BORROWED  _PAGE_SOFTW2
+
+        /*
+         * npf error code is described in "15.25.6" on page 550 at
+         * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+         */
+        #define YAKVM_NPF_INFO1_P   (1ul << 0)
+        #define YAKVM_NPF_INFO1_RW  (1ul << 1)
+
         #include <asm/io.h>
         #define PHYS_ADDR_MASK      ((1ul << 52) - 1)
         /* transfer physical base address to its page physical address */
@@ -62,6 +172,23 @@
 
         struct page *yakvm_vmm_npt_create(struct vmm *vmm,
                                           unsigned long gpa, bool is_mmio);
+        entry *yakvm_vmm_npt_lookup(struct vmm *vmm, unsigned long gpa,
+                                    int *level);
+        bool yakvm_vmm_is_ram(struct vmm *vmm, unsigned long gpa);
+        int yakvm_vmm_set_mmio(struct vmm *vmm, unsigned long gpa,
+                               unsigned long size);
+        struct page *yakvm_vmm_host_page(struct vmm *vmm, unsigned long gpa);
+        int yakvm_vmm_set_region(struct vmm *vmm,
+                                 const struct memory_region *region);
+        long yakvm_vmm_prefault(struct vmm *vmm, unsigned long gpa,
+                                unsigned long size, struct page **pages);
+        bool yakvm_vmm_log_dirty(struct vmm *vmm, unsigned long gpa);
+        int yakvm_vmm_get_dirty_log(struct vmm *vmm, uint32_t slot,
+                                    void __user *bitmap);
+        int yakvm_vmm_read(struct vmm *vmm, unsigned long gpa,
+                           void *buf, unsigned long len);
+        int yakvm_create_vmm_cache(void);
+        void yakvm_destroy_vmm_cache(void);
         struct vmm *yakvm_create_vmm(struct vm *vm);
         void yakvm_destroy_vmm(struct vmm *vmm);
     #else // __KERNEL__
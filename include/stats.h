@@ -0,0 +1,101 @@
+#ifndef __YAKVM_STATS_H_
+
+        #define __YAKVM_STATS_H_
+
+        /*
+         * binary statistics shared by the kernel with the userspace,
+         * which are read through read() or mmap() on the fd returned
+         * by *YAKVM_GET_STATS_FD* on the vm or vcpu fd.
+         *
+         * The stats begin with the *stats_header*, followed by
+         * *num_desc* descriptors at *desc_offset*, which describe the
+         * uint64_t values at *data_offset*. The descriptors never
+         * change, so the userspace only parses them once and then
+         * samples the values without any syscall.
+         */
+        #ifndef __KERNEL__
+                #include <stdint.h>
+        #endif // __KERNEL__
+
+        #define YAKVM_STATS_MAX_ID              32
+        struct stats_header {
+                uint32_t num_desc;               // number of descriptors
+                uint32_t desc_offset;            // offset of descriptors
+                uint32_t data_offset;            // offset of the values
+                uint32_t size;                   // size of the whole stats
+                char id[YAKVM_STATS_MAX_ID];     // e.g. "kvm-1" or "kvm-1/vcpu-0"
+        };
+
+        #define YAKVM_STATS_TYPE_COUNTER        0    // monotonic counter
+        #define YAKVM_STATS_TYPE_HIST_LOG2      1    // value in [2^i, 2^(i+1)) counted at i
+
+        #define YAKVM_STATS_UNIT_NONE           0
+        #define YAKVM_STATS_UNIT_CYCLES         1    // tsc cycles
+        #define YAKVM_STATS_UNIT_PAGES          2
+
+        #define YAKVM_STATS_MAX_NAME            48
+        struct stats_desc {
+                uint32_t type;                   // YAKVM_STATS_TYPE_*
+                uint32_t unit;                   // YAKVM_STATS_UNIT_*
+                uint32_t offset;                 // byte offset from data_offset
+                uint32_t size;                   // number of uint64_t values
+                char name[YAKVM_STATS_MAX_NAME];
+        };
+
+        /* *exits* is indexed by the exit code up to the *VMEXIT_NPF* */
+        #define YAKVM_STATS_NR_EXITS            (0x400 + 1)
+        #define YAKVM_STATS_HIST_SIZE           64
+
+        #ifdef __KERNEL__
+                #include <linux/types.h>
+
+                /* values of the vm stats */
+                struct vm_stats {
+                        uint64_t npt_pages;             // NPT leaves populated
+                };
+
+                /* values of the vcpu stats */
+                struct vcpu_stats {
+                        uint64_t exits[YAKVM_STATS_NR_EXITS];
+                        uint64_t userspace_exits;       // returns to userspace
+                        uint64_t guest_cycles;          // cycles in the guest
+                        uint64_t host_cycles;           // cycles handling exits
+                        uint64_t exit_latency[YAKVM_STATS_HIST_SIZE];
+                };
+
+                struct vm;
+
+                /* create the stats for @num descriptors, named @id */
+                struct stats_header *yakvm_create_stats(
+                        const struct stats_desc *descs, uint32_t num,
+                        const char *id);
+                void yakvm_destroy_stats(struct stats_header *header);
+
+                /* return the values described by the descriptors */
+                static inline void *yakvm_stats_data(struct stats_header *header)
+                {
+                        return (void *)header + header->data_offset;
+                }
+
+                /* count @value into the log2 histogram @hist */
+                static inline void yakvm_stats_hist_log2(uint64_t *hist,
+                                                         uint64_t value)
+                {
+                        hist[value ? fls64(value) - 1 : 0]++;
+                }
+
+                /* return the read-only stats fd, which holds the @vm */
+                int yakvm_stats_getfd(struct vm *vm,
+                                      struct stats_header *header);
+
+                extern const struct stats_desc yakvm_vm_stats_descs[];
+                extern const uint32_t yakvm_vm_stats_num;
+                extern const struct stats_desc yakvm_vcpu_stats_descs[];
+                extern const uint32_t yakvm_vcpu_stats_num;
+        #endif // __KERNEL__
+
+        #include "../include/yakvm.h"
+        /* ioctl for both vm and vcpu fds, returns a stats fd */
+        #define YAKVM_GET_STATS_FD      _IO(YAKVMIO,   0x30)
+
+#endif // __YAKVM_STATS_H_
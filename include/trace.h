@@ -0,0 +1,150 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM yakvm
+
+#if !defined(__YAKVM_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+
+        #define __YAKVM_TRACE_H_
+
+        /*
+         * tracepoints for the hot path and the object lifecycle, which
+         * cost nearly nothing when disabled and can be enabled through
+         * perf or ftrace at /sys/kernel/tracing/events/yakvm/.
+         */
+        #include <linux/tracepoint.h>
+        #include "cpu.h"
+        #include "vm.h"
+
+        DECLARE_EVENT_CLASS(yakvm_vm,
+                TP_PROTO(struct vm *vm),
+                TP_ARGS(vm),
+
+                TP_STRUCT__entry(
+                        __string(id, vm->id)
+                ),
+
+                TP_fast_assign(
+                        __assign_str(id, vm->id);
+                ),
+
+                TP_printk("vm %s", __get_str(id))
+        );
+
+        DEFINE_EVENT(yakvm_vm, yakvm_create_vm,
+                TP_PROTO(struct vm *vm),
+                TP_ARGS(vm)
+        );
+
+        DEFINE_EVENT(yakvm_vm, yakvm_destroy_vm,
+                TP_PROTO(struct vm *vm),
+                TP_ARGS(vm)
+        );
+
+        DECLARE_EVENT_CLASS(yakvm_vcpu,
+                TP_PROTO(struct vcpu *vcpu),
+                TP_ARGS(vcpu),
+
+                TP_STRUCT__entry(
+                        __string(id, vcpu->vm->id)
+                        __field(unsigned int, vcpu)
+                ),
+
+                TP_fast_assign(
+                        __assign_str(id, vcpu->vm->id);
+                        __entry->vcpu = vcpu->id;
+                ),
+
+                TP_printk("vm %s vcpu %u", __get_str(id), __entry->vcpu)
+        );
+
+        DEFINE_EVENT(yakvm_vcpu, yakvm_create_vcpu,
+                TP_PROTO(struct vcpu *vcpu),
+                TP_ARGS(vcpu)
+        );
+
+        DEFINE_EVENT(yakvm_vcpu, yakvm_destroy_vcpu,
+                TP_PROTO(struct vcpu *vcpu),
+                TP_ARGS(vcpu)
+        );
+
+        /* right before the *vmrun* */
+        TRACE_EVENT(yakvm_entry,
+                TP_PROTO(struct vcpu *vcpu),
+                TP_ARGS(vcpu),
+
+                TP_STRUCT__entry(
+                        __field(unsigned int, vcpu)
+                        __field(u64, cs)
+                        __field(u64, rip)
+                ),
+
+                TP_fast_assign(
+                        __entry->vcpu = vcpu->id;
+                        __entry->cs = vcpu->gctx.vmcb->save.cs.base;
+                        __entry->rip = vcpu->gctx.vmcb->save.rip;
+                ),
+
+                TP_printk("vcpu %u cs %#llx rip %#llx", __entry->vcpu,
+                          __entry->cs, __entry->rip)
+        );
+
+        /* right after the *vmexit*, with the exit reason */
+        TRACE_EVENT(yakvm_exit,
+                TP_PROTO(struct vcpu *vcpu),
+                TP_ARGS(vcpu),
+
+                TP_STRUCT__entry(
+                        __field(unsigned int, vcpu)
+                        __field(u32, exit_code)
+                        __field(u64, exit_info_1)
+                        __field(u64, exit_info_2)
+                        __field(u64, cs)
+                        __field(u64, rip)
+                ),
+
+                TP_fast_assign(
+                        __entry->vcpu = vcpu->id;
+                        __entry->exit_code =
+                                vcpu->gctx.vmcb->control.exit_code;
+                        __entry->exit_info_1 =
+                                vcpu->gctx.vmcb->control.exit_info_1;
+                        __entry->exit_info_2 =
+                                vcpu->gctx.vmcb->control.exit_info_2;
+                        __entry->cs = vcpu->gctx.vmcb->save.cs.base;
+                        __entry->rip = vcpu->gctx.vmcb->save.rip;
+                ),
+
+                TP_printk("vcpu %u exit_code %#x info1 %#llx info2 %#llx "
+                          "cs %#llx rip %#llx", __entry->vcpu,
+                          __entry->exit_code, __entry->exit_info_1,
+                          __entry->exit_info_2, __entry->cs, __entry->rip)
+        );
+
+        /* a leaf of the NPT is populated for @gpa */
+        TRACE_EVENT(yakvm_npt_populate,
+                TP_PROTO(unsigned long gpa, unsigned long hpa, bool is_mmio),
+                TP_ARGS(gpa, hpa, is_mmio),
+
+                TP_STRUCT__entry(
+                        __field(unsigned long, gpa)
+                        __field(unsigned long, hpa)
+                        __field(bool, is_mmio)
+                ),
+
+                TP_fast_assign(
+                        __entry->gpa = gpa;
+                        __entry->hpa = hpa;
+                        __entry->is_mmio = is_mmio;
+                ),
+
+                TP_printk("gpa %#lx hpa %#lx%s", __entry->gpa, __entry->hpa,
+                          __entry->is_mmio ? " mmio" : "")
+        );
+
+#endif // __YAKVM_TRACE_H_
+
+/* this part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
@@ -3,26 +3,49 @@
         #define __YAKVM_VM_H_
 
         #ifdef __KERNEL__
+                #include <linux/list.h>
                 #include <linux/mutex.h>
+                #include <linux/spinlock.h>
                 #include <linux/types.h>
+                #include <linux/workqueue.h>
                 #include <linux/xarray.h>
                 #define YAKVM_VM_MAX_ID         32
                 /* virtual machine data structure */
                 struct vm {
                         struct mutex lock;
                         atomic_t refcount;
-                        struct vcpu *vcpu;
+                        struct xarray vcpus;    /* indexed by the vcpu id */
                         struct vmm *vmm;
+                        struct coalesced *coalesced;
+                        struct iopm *iopm;      /* replaced under *lock* */
+                        spinlock_t ioeventfds_lock;
+                        struct list_head ioeventfds;
+                        struct list_head irqfds;
+                        struct stats_header *stats_header;
+                        struct vm_stats *stats;
+                        struct work_struct destroy_work;
                         char id[YAKVM_VM_MAX_ID];
                 };
 
+                /* allocate and free the slab cache of the vms */
+                extern int yakvm_create_vm_cache(void);
+                extern void yakvm_destroy_vm_cache(void);
+
+                /* allocate and drain the workqueue destroying the vms */
+                extern int yakvm_create_vm_reaper(void);
+                extern void yakvm_destroy_vm_reaper(void);
+
                 /* create the vm */
                 extern struct vm* yakvm_create_vm(void);
 
                 /* destory the vm */
                 extern void yakvm_destroy_vm(struct vm *vm);
 
-                /* put the vm */
+                /* flush the TLB of all vcpus after the NPT changes */
+                extern void yakvm_vm_flush_tlb(struct vm *vm);
+
+                /* get and put the vm */
+                extern void yakvm_get_vm(struct vm *vm);
                 extern void yakvm_put_vm(struct vm *vm);
 
                 #include <linux/fs.h>
@@ -30,9 +53,18 @@
                 extern const struct file_operations yakvm_vm_fops;
         #endif //__KERNEL__
 
+        /* vcpu ids passed to *YAKVM_CREATE_VCPU* are in [0, YAKVM_MAX_VCPUS) */
+        #define YAKVM_MAX_VCPUS         64
+
         #include "../include/yakvm.h"
         /* ioctls for vm fds */
-        #define YAKVM_CREATE_VCPU       _IO(YAKVMIO,   0x10) /* returns a vcpu fd */
+        #define YAKVM_CREATE_VCPU       _IO(YAKVMIO,   0x10) /* create vcpu with id, returns a vcpu fd */
         #define YAKVM_MMAP_PAGE         _IO(YAKVMIO,   0x11) /* map the gpa to hpa */
+        #define YAKVM_REGISTER_COALESCED _IO(YAKVMIO,  0x12) /* coalesce writes to zone */
+        #define YAKVM_IOEVENTFD         _IO(YAKVMIO,   0x13) /* bind write to eventfd */
+        #define YAKVM_IRQFD             _IO(YAKVMIO,   0x14) /* bind eventfd to vector */
+        #define YAKVM_SET_MEMORY_REGION _IO(YAKVMIO,   0x15) /* back guest ram with user memory */
+        #define YAKVM_PREFAULT          _IO(YAKVMIO,   0x16) /* populate gpa ranges, returns pages */
+        #define YAKVM_GET_DIRTY_LOG     _IO(YAKVMIO,   0x17) /* fetch and clear dirty bitmap */
 
 #endif // __YAKVM_VM_H_
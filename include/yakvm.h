@@ -10,12 +10,21 @@
         #ifdef __KERNEL__
                 #include <linux/printk.h>
                 #include <linux/kern_levels.h>
-                #define log(level, args...) do { \
-                        printk(KERN_DEFAULT level); \
-                        printk(KERN_CONT "[yakvm(%s:%d)]: ", __FILE__, __LINE__); \
-                        printk(KERN_CONT args); \
-                        printk(KERN_CONT LOG_NONE "\n"); \
-                } while(0)
+                /*
+                 * emit the whole line in one printk, where only the
+                 * errors, reachable by the guest, are ratelimited so
+                 * they can not flood the console, while the rare
+                 * lifecycle info is never dropped. Use the tracepoints
+                 * in trace.h for the per-event tracing instead.
+                 */
+                #define yakvm_printk_LOG_INFO(fmt, args...) \
+                        printk(KERN_DEFAULT fmt, ##args)
+                #define yakvm_printk_LOG_ERR(fmt, args...) \
+                        printk_ratelimited(KERN_DEFAULT fmt, ##args)
+                #define log(level, fmt, args...) \
+                        yakvm_printk_##level(level "[yakvm(%s:%d)]: " fmt \
+                                             LOG_NONE "\n", \
+                                             __FILE__, __LINE__, ##args)
         #else // __KERNEL__
                 #include <stdio.h>
                 #define log(level, args...) do { \
@@ -200,7 +200,7 @@ if __name__ == "__main__":
         qemu.execute("insmod /mnt/shares/yakvm.ko")
         qemu.runtil("initialize yakvm", timeout=args.timeout)
 
-        qemu.execute("/mnt/shares/emulator /mnt/shares/guest.bin")
+        qemu.execute("/mnt/shares/emulator --trace /mnt/shares/guest.bin")
         qemu.runtil("yakvm_create_vm() creates the kvm", timeout=args.timeout)
         qemu.runtil("vcpu has been created for kvm", timeout=args.timeout)
 
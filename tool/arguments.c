@@ -4,6 +4,7 @@
 
 /* available arguments */
 static struct argp_option options[] = {
+    {"trace", 't', 0, 0, "trace every guest instruction"},
     {},
 };
 
@@ -14,6 +15,10 @@ static error_t parse_opt(int key, char *arg,
     long ret = 0;
 
     switch (key) {
+        case 't':
+            args->trace = true;
+            break;
+
         case ARGP_KEY_ARG:
             args->bin = arg;
             log(LOG_INFO, "parse_opt() sets bin to %s", arg);
@@ -2,8 +2,10 @@
 
         #define __YAKVM_TOOL_ARGUMENTS_H_
 
+        #include <stdbool.h>
         struct arguments {
                 char *bin; /* path to the guest bin to be used */
+                bool trace; /* trace every guest instruction */
         };
 
         /* parse arguments from *argv* into *args* */
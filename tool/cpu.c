@@ -5,30 +5,35 @@
 #include <unistd.h>
 #include "cpu.h"
 #include "devices.h"
+#include "io.h"
 #include "memory.h"
 #include "emulator.h"
 #include "../include/vm.h"
 
-int yakvm_create_cpu(struct vm *vm)
+int yakvm_create_cpu(struct vm *vm, int id, bool trace)
 {
     int ret = 0;
+    struct cpu *cpu = &vm->cpus[id];
     struct registers regs = {};
 
-    vm->cpu.fd = ioctl(vm->vmfd, YAKVM_CREATE_VCPU);
+    cpu->vm = vm;
+    cpu->id = id;
+    cpu->fd = ioctl(vm->vmfd, YAKVM_CREATE_VCPU, id);
     sleep(2); // for test check
-    if (vm->cpu.fd < 0) {
+    if (cpu->fd < 0) {
             ret = errno;
             log(LOG_ERR, "ioctl(YAKVM_CREATE_VCPU) failed with error %s",
                 strerror(errno));
             goto out;
     }
 
-    assert((ioctl(vm->vmfd, YAKVM_CREATE_VCPU) == -1) && (errno == EEXIST));
+    assert((ioctl(vm->vmfd, YAKVM_CREATE_VCPU, id) == -1) &&
+           (errno == EEXIST));
     sleep(2); // for test check
 
-    vm->cpu.state = mmap(NULL, sizeof(*vm->cpu.state),
-                         PROT_READ | PROT_WRITE,MAP_SHARED, vm->cpu.fd, 0);
-    if (vm->cpu.state == MAP_FAILED) {
+    cpu->state = mmap(NULL, sizeof(*cpu->state),
+                      PROT_READ | PROT_WRITE,MAP_SHARED, cpu->fd, 0);
+    if (cpu->state == MAP_FAILED) {
             ret = errno;
             log(LOG_ERR, "mmap() failed with error %s",
                 strerror(errno));
@@ -42,152 +47,183 @@ int yakvm_create_cpu(struct vm *vm)
      * by left-shifting the selector until the selector register is
      * loaded by software according to "14.1.5" on page 482 at
      * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
+     *
+     * All vcpus start at the entry, each with its own slice of
+     * the stack page.
      */
-    assert(ioctl(vm->cpu.fd, YAKVM_GET_REGS, &regs) == 0);
+    assert(ioctl(cpu->fd, YAKVM_GET_REGS, &regs) == 0);
     assert(YAKVM_ENTRY % PAGE_SIZE == 0);
     regs.cs = YAKVM_ENTRY;
     regs.rip = 0;
     assert(YAKVM_STACK % PAGE_SIZE == 0);
     regs.ss = YAKVM_STACK;
-    regs.rsp = 0x1000;
-    assert(ioctl(vm->cpu.fd, YAKVM_SET_REGS, &regs) == 0);
+    regs.rsp = 0x1000 - id * (0x1000 / YAKVM_NR_CPUS);
+    assert(ioctl(cpu->fd, YAKVM_SET_REGS, &regs) == 0);
 
-    vm->cpu.mode = RUNNING;
+    cpu->trace = NULL;
+    if (trace) {
+            if (ioctl(cpu->fd, YAKVM_TRACE, true)) {
+                    ret = errno;
+                    log(LOG_ERR, "ioctl(YAKVM_TRACE) failed with error %s",
+                        strerror(errno));
+                    goto munmap_state;
+            }
+
+            cpu->trace = mmap(NULL, YAKVM_TRACE_RING_SIZE,
+                              PROT_READ | PROT_WRITE, MAP_SHARED,
+                              cpu->fd, YAKVM_TRACE_RING_OFFSET);
+            if (cpu->trace == MAP_FAILED) {
+                    ret = errno;
+                    log(LOG_ERR, "mmap() failed with error %s",
+                        strerror(errno));
+                    goto munmap_state;
+            }
+    }
+
+    cpu->mode = RUNNING;
 
     return 0;
 
+munmap_state:
+    assert(!munmap(cpu->state, sizeof(*cpu->state)));
 close_cpufd:
-    assert(!close(vm->cpu.fd));
+    assert(!close(cpu->fd));
 out:
     return ret;
 }
 
-void yakvm_destroy_cpu(struct vm *vm)
+void yakvm_destroy_cpu(struct cpu *cpu)
 {
-    assert(!munmap(vm->cpu.state, sizeof(*vm->cpu.state)));
-    assert(!close(vm->cpu.fd));
+    if (cpu->trace) {
+            assert(!munmap(cpu->trace, YAKVM_TRACE_RING_SIZE));
+    }
+    assert(!munmap(cpu->state, sizeof(*cpu->state)));
+    assert(!close(cpu->fd));
 }
 
 /*
- * Emulating the mmio instruction. For simplicity, we only
- * support the *movb (edx), al* and *movb al, (edx)*
- * instructions, where %edx holds the mmio address and
- * %al holds the value.
+ * Emulating the mmio instruction decoded by the kernel into
+ * *state.io*, the kernel also updates the rip to the next
+ * instruction address.
  */
-static void yakvm_vcpu_handle_mmio(struct vm *vm)
+static void yakvm_vcpu_handle_mmio(struct cpu *cpu)
 {
-        uint32_t ip = vm->cpu.state->cs + vm->cpu.state->rip;
-        struct registers regs;
-
-        /*
-         * The address-size override prefix can override the
-         * default 16-bit addresses to effective 32-bit addresses
-         * according to "1.2.3" on page 9 at
-         * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24594.pdf
-         */
-        assert(vm->memory[ip] == 0x67);
-
-        /*
-         * Opcode 0x88 represents *mov mem8, reg8*, which is mmio out
-         * instruction, and Opcode 0x8a represents *mov reg8, mem8*,
-         * which is mmio in instruction, according to "MOV" on page 234 at
-         * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24594.pdf
-         *
-         * Operands should be in ModRM byte format, meaning
-         * %edx contains the mmio address an %al holds the
-         * vlaue described in "1.4.3" on page 21 at
-         * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24594.pdf
-         */
-        assert(ioctl(vm->cpu.fd, YAKVM_GET_REGS, &regs) == 0);
-        switch (vm->memory[ip + 1]) {
-                case 0x88:
-                        assert(vm->memory[ip + 2] == 0x02);
-                        assert(regs.rdx == YAKVM_MMIO_HAWK);
-                        yakvm_device_mmio_set(regs.rax);
-                        break;
+        struct io *io = &cpu->state->io;
 
-                case 0x8a:
-                        assert(vm->memory[ip + 2] == 0x02);
-                        assert(regs.rdx == YAKVM_MMIO_HAWK);
-                        regs.rax = yakvm_device_mmio_get();
-                        break;
+        assert(io->type == YAKVM_IO_MMIO);
+        assert(io->size == 1);
+        assert(io->address == YAKVM_MMIO_HAWK);
 
-                default:
-                        /* code should not reach here */
-                        assert(false);
-                        break;
+        /* the devices are shared by the vcpus and the iothread */
+        assert(!pthread_mutex_lock(&cpu->vm->iothread.lock));
+        if (io->direction == YAKVM_IO_IN) {
+                io->data = yakvm_device_mmio_get();
+        } else {
+                yakvm_device_mmio_set(io->data);
         }
-
-        /* update the rip to the next instruction address */
-        regs.rip += 3;
-        assert(ioctl(vm->cpu.fd, YAKVM_SET_REGS, &regs) == 0);
+        assert(!pthread_mutex_unlock(&cpu->vm->iothread.lock));
 }
 
-static void yakvm_cpu_handle_npf(struct vm *vm)
+/*
+ * The guest ram is populated inside the kernel, so only the
+ * mmio reaches here.
+ */
+static int yakvm_cpu_handle_npf(struct cpu *cpu)
 {
-        if (vm->cpu.state->exit_info_2 == YAKVM_MMIO_HAWK) {
-                yakvm_vcpu_handle_mmio(vm);
-        } else {
-                assert(ioctl(vm->vmfd, YAKVM_MMAP_PAGE,
-                             yakvm_page(vm->cpu.state->exit_info_2)) == 0);
+        if (cpu->state->exit_info_2 != YAKVM_MMIO_HAWK) {
+                log(LOG_ERR, "improper npf gpa %#lx",
+                    cpu->state->exit_info_2);
+                return -EINVAL;
         }
+
+        yakvm_vcpu_handle_mmio(cpu);
+        return 0;
 }
 
-static void yakvm_cpu_handle_ioio(struct vm *vm)
+static void yakvm_cpu_handle_ioio(struct cpu *cpu)
 {
-        struct registers regs;
-        uint32_t info = vm->cpu.state->exit_info_1;
-        assert(svm_ioio_is_size8(info));
-        assert(svm_ioio_port(info) == YAKVM_PIO_HAWK);
+        struct io *io = &cpu->state->io;
+
+        assert(io->type == YAKVM_IO_PIO);
+        assert(io->size == 1);
+        assert(io->address == YAKVM_PIO_HAWK);
 
         /*
          * IN/OUT instruction is described at
          * "IN" on page 182 and "OUT" on page "267" at
          * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24594.pdf
          */
-        assert(ioctl(vm->cpu.fd, YAKVM_GET_REGS, &regs) == 0);
-        if (svm_ioio_type(info) == SVM_IOIO_TYPE_IN) {
-                regs.rax = yakvm_device_pio_get();
+        assert(!pthread_mutex_lock(&cpu->vm->iothread.lock));
+        if (io->direction == YAKVM_IO_IN) {
+                io->data = yakvm_device_pio_get();
         } else {
-                yakvm_device_pio_set(regs.rax);
+                yakvm_device_pio_set(io->data);
         }
+        assert(!pthread_mutex_unlock(&cpu->vm->iothread.lock));
+}
 
-        /*
-         * The rip of the instruction following the IN/OUT is saved in
-         * EXITINFO2, so that the VMM can easily resume the guest after
-         * I/O emulation according to "15.10.2" on page 516 at
-         * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
-         */
-        regs.rip = vm->cpu.state->exit_info_2;
-        assert(ioctl(vm->cpu.fd, YAKVM_SET_REGS, &regs) == 0);
+/*
+ * consume the exits recorded by the kernel in the trace ring,
+ * which all happen before the current exit.
+ */
+static void yakvm_cpu_trace_drain(struct cpu *cpu)
+{
+        struct trace_ring *ring = cpu->trace;
+        struct trace_entry *entry;
+        uint32_t first, last;
+
+        if (!ring) {
+                return;
+        }
+
+        first = ring->first;
+        last = __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE);
+        while (first != last) {
+                entry = &ring->entries[first];
+                if (entry->exit_code == SVM_EXIT_EXCP_BASE + DB_VECTOR) {
+                        log(LOG_INFO, "guest executes instruction at "
+                            "%#lx, opcode = %hhx", entry->cs + entry->rip,
+                            entry->insn_len ? entry->insn[0] :
+                            cpu->vm->memory[entry->cs + entry->rip]);
+                }
+                first = (first + 1) % YAKVM_TRACE_RING_MAX;
+        }
+        __atomic_store_n(&ring->first, first, __ATOMIC_RELEASE);
 }
 
-static int yakvm_cpu_handle_exit(struct vm *vm)
+static int yakvm_cpu_handle_exit(struct cpu *cpu)
 {
-        switch (vm->cpu.state->exit_code) {
+        /* coalesced writes happen before this exit */
+        yakvm_io_drain(cpu->vm);
+        yakvm_cpu_trace_drain(cpu);
+
+        switch (cpu->state->exit_code) {
                 case SVM_EXIT_NPF:
-                        yakvm_cpu_handle_npf(vm);
-                        break;
+                        return yakvm_cpu_handle_npf(cpu);
 
                 case SVM_EXIT_EXCP_BASE + DB_VECTOR:
                         log(LOG_INFO, "guest executes instruction at "
-                            "%#lx, opcode = %hhx", vm->cpu.state->cs +
-                                                   vm->cpu.state->rip,
-                            vm->memory[vm->cpu.state->cs +
-                                       vm->cpu.state->rip]);
+                            "%#lx, opcode = %hhx", cpu->state->cs +
+                                                   cpu->state->rip,
+                            cpu->vm->memory[cpu->state->cs +
+                                            cpu->state->rip]);
                         break;
 
                 case SVM_EXIT_HLT:
-                        vm->cpu.mode = HLT;
+                        cpu->mode = HLT;
                         break;
 
                 case SVM_EXIT_IOIO:
-                        yakvm_cpu_handle_ioio(vm);
+                        yakvm_cpu_handle_ioio(cpu);
+                        break;
+
+                case YAKVM_EXIT_INTR:
+                        /* nothing to handle, just re-enter the guest */
                         break;
 
                 default:
                         log(LOG_ERR, "improper exit_code %#x",
-                            vm->cpu.state->exit_code);
+                            cpu->state->exit_code);
                         return -EINVAL;
         }
 
@@ -200,10 +236,37 @@ static int yakvm_cpu_handle_exit(struct vm *vm)
  * *vmcb* according to *Appendix C* on page 745 at
  * https://www.amd.com/content/dam/amd/en/documents/processor-tech-docs/programmer-references/24593.pdf
  */
-void yakvm_cpu_run(struct vm *vm)
+static void *yakvm_cpu_run(void *arg)
+{
+        struct cpu *cpu = arg;
+
+        while(cpu->mode == RUNNING) {
+                /* interrupted by signals with *YAKVM_EXIT_INTR* */
+                assert((ioctl(cpu->fd, YAKVM_RUN) == 0) || (errno == EINTR));
+                assert(yakvm_cpu_handle_exit(cpu) == 0);
+        }
+
+        return NULL;
+}
+
+/* run each vcpu on its own thread until all of them halt */
+int yakvm_run_cpus(struct vm *vm)
 {
-        while(vm->cpu.mode == RUNNING) {
-                assert(ioctl(vm->cpu.fd, YAKVM_RUN) == 0);
-                assert(yakvm_cpu_handle_exit(vm) == 0);
+        int ret = 0, nr;
+
+        for (nr = 0; nr < YAKVM_NR_CPUS; ++nr) {
+                ret = pthread_create(&vm->cpus[nr].thread, NULL,
+                                     yakvm_cpu_run, &vm->cpus[nr]);
+                if (ret) {
+                        log(LOG_ERR, "pthread_create() failed with error %s",
+                            strerror(ret));
+                        break;
+                }
         }
+
+        while (nr--) {
+                assert(!pthread_join(vm->cpus[nr].thread, NULL));
+        }
+
+        return ret;
 }
@@ -7,6 +7,7 @@
 #include "arguments.h"
 #include "cpu.h"
 #include "emulator.h"
+#include "io.h"
 #include "memory.h"
 #include "../include/yakvm.h"
 
@@ -14,7 +15,7 @@ int main(int argc, char *argv[])
 {
         struct arguments args = {};
         struct vm vm;
-        int yakvmfd, ret;
+        int yakvmfd, ret, nr = 0;
 
         emulator_parse_arguments(&args, argc, argv);
 
@@ -40,18 +41,35 @@ int main(int argc, char *argv[])
                 goto close_vmfd;
         }
 
-        ret = yakvm_create_cpu(&vm);
+        ret = yakvm_create_io(&vm);
         if (ret) {
-                log(LOG_ERR, "yakvm_create_cpu() "
+                log(LOG_ERR, "yakvm_create_io() "
                     "failed with error %d", ret);
                 goto destroy_memory;
         }
 
-        yakvm_cpu_run(&vm);
+        for (nr = 0; nr < YAKVM_NR_CPUS; ++nr) {
+                ret = yakvm_create_cpu(&vm, nr, args.trace);
+                if (ret) {
+                        log(LOG_ERR, "yakvm_create_cpu() "
+                            "failed with error %d", ret);
+                        goto destroy_cpus;
+                }
+        }
+
+        ret = yakvm_run_cpus(&vm);
+        if (ret) {
+                log(LOG_ERR, "yakvm_run_cpus() "
+                    "failed with error %d", ret);
+        }
 
         sleep(2); // for test check
 
-        yakvm_destroy_cpu(&vm);
+destroy_cpus:
+        while (nr--) {
+                yakvm_destroy_cpu(&vm.cpus[nr]);
+        }
+        yakvm_destroy_io(&vm);
 destroy_memory:
         yakvm_destroy_memory(&vm);
 close_vmfd:
@@ -4,10 +4,15 @@
 
     #include "../include/cpu.h"
     #include "cpu.h"
+    #include "io.h"
+    #include "../include/vm.h"
+    static_assert(YAKVM_NR_CPUS > 0 && YAKVM_NR_CPUS <= YAKVM_MAX_VCPUS);
     struct vm {
         int vmfd;
-        struct cpu cpu;
+        struct cpu cpus[YAKVM_NR_CPUS];
         uint8_t *memory;
+        struct coalesced_ring *coalesced;
+        struct iothread iothread;
     };
 
 #endif // __YAKVM_TOOL_EMULATOR_H_
@@ -0,0 +1,148 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "devices.h"
+#include "emulator.h"
+#include "io.h"
+#include "memory.h"
+#include "../include/cpu.h"
+#include "../include/vm.h"
+
+/* write-only device registers whose writes can be coalesced */
+static const struct coalesced_zone zones[] = {
+        {.address = YAKVM_PIO_HAWK, .size = 1, .type = YAKVM_IO_PIO},
+        {.address = YAKVM_MMIO_HAWK, .size = 1, .type = YAKVM_IO_MMIO},
+};
+
+/*
+ * replay the coalesced writes in order, which must be done
+ * before handling any exit to keep the device state coherent.
+ */
+void yakvm_io_drain(struct vm *vm)
+{
+        struct coalesced_ring *ring = vm->coalesced;
+        uint32_t first;
+
+        assert(!pthread_mutex_lock(&vm->iothread.lock));
+
+        first = ring->first;
+        while (first != __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE)) {
+                struct coalesced_entry *entry = &ring->entries[first];
+
+                if (entry->type == YAKVM_IO_PIO) {
+                        assert(entry->address == YAKVM_PIO_HAWK);
+                        yakvm_device_pio_set(entry->data);
+                } else {
+                        assert(entry->address == YAKVM_MMIO_HAWK);
+                        yakvm_device_mmio_set(entry->data);
+                }
+
+                first = (first + 1) % YAKVM_COALESCED_RING_MAX;
+                __atomic_store_n(&ring->first, first, __ATOMIC_RELEASE);
+        }
+
+        assert(!pthread_mutex_unlock(&vm->iothread.lock));
+}
+
+/*
+ * service the device doorbells asynchronously, while the
+ * vcpu keeps executing the guest.
+ */
+static void *yakvm_iothread(void *arg)
+{
+        struct vm *vm = arg;
+        uint64_t count;
+
+        while (read(vm->iothread.eventfd, &count, sizeof(count)) ==
+               sizeof(count)) {
+                if (__atomic_load_n(&vm->iothread.stop, __ATOMIC_ACQUIRE)) {
+                        break;
+                }
+                yakvm_io_drain(vm);
+        }
+
+        return NULL;
+}
+
+int yakvm_create_io(struct vm *vm)
+{
+        struct ioeventfd args = {};
+        int ret = 0;
+
+        vm->coalesced = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, vm->vmfd,
+                             YAKVM_COALESCED_RING_OFFSET);
+        if (vm->coalesced == MAP_FAILED) {
+                ret = errno;
+                log(LOG_ERR, "mmap() failed with error %s",
+                    strerror(errno));
+                goto out;
+        }
+
+        vm->iothread.eventfd = eventfd(0, EFD_CLOEXEC);
+        if (vm->iothread.eventfd < 0) {
+                ret = errno;
+                log(LOG_ERR, "eventfd() failed with error %s",
+                    strerror(errno));
+                goto munmap;
+        }
+
+        /* the eventfd rings the doorbell for the coalesced zones */
+        for (int i = 0; i < sizeof(zones) / sizeof(zones[0]); ++i) {
+                if (ioctl(vm->vmfd, YAKVM_REGISTER_COALESCED, &zones[i])) {
+                        ret = errno;
+                        log(LOG_ERR, "ioctl(YAKVM_REGISTER_COALESCED) "
+                            "failed with error %s", strerror(errno));
+                        goto close_eventfd;
+                }
+
+                args.address = zones[i].address;
+                args.size = zones[i].size;
+                args.fd = vm->iothread.eventfd;
+                args.flags = zones[i].type == YAKVM_IO_PIO ?
+                             YAKVM_IOEVENTFD_FLAG_PIO : 0;
+                if (ioctl(vm->vmfd, YAKVM_IOEVENTFD, &args)) {
+                        ret = errno;
+                        log(LOG_ERR, "ioctl(YAKVM_IOEVENTFD) "
+                            "failed with error %s", strerror(errno));
+                        goto close_eventfd;
+                }
+        }
+
+        assert(!pthread_mutex_init(&vm->iothread.lock, NULL));
+        vm->iothread.stop = false;
+        ret = pthread_create(&vm->iothread.thread, NULL,
+                             yakvm_iothread, vm);
+        if (ret) {
+                log(LOG_ERR, "pthread_create() failed with error %s",
+                    strerror(ret));
+                goto destroy_lock;
+        }
+
+        return 0;
+
+destroy_lock:
+        assert(!pthread_mutex_destroy(&vm->iothread.lock));
+close_eventfd:
+        assert(!close(vm->iothread.eventfd));
+munmap:
+        assert(!munmap(vm->coalesced, PAGE_SIZE));
+out:
+        return ret;
+}
+
+void yakvm_destroy_io(struct vm *vm)
+{
+        uint64_t count = 1;
+
+        __atomic_store_n(&vm->iothread.stop, true, __ATOMIC_RELEASE);
+        assert(write(vm->iothread.eventfd, &count, sizeof(count)) ==
+               sizeof(count));
+        assert(!pthread_join(vm->iothread.thread, NULL));
+        assert(!pthread_mutex_destroy(&vm->iothread.lock));
+        assert(!close(vm->iothread.eventfd));
+        assert(!munmap(vm->coalesced, PAGE_SIZE));
+}
@@ -0,0 +1,22 @@
+#ifndef __YAKVM_TOOL_IO_H_
+
+        #define __YAKVM_TOOL_IO_H_
+
+        #include <pthread.h>
+        #include <stdbool.h>
+        #include "../include/io.h"
+
+        /* thread draining the coalesced ring on the doorbell eventfd */
+        struct iothread {
+                pthread_t thread;
+                pthread_mutex_t lock;
+                int eventfd;
+                bool stop;
+        };
+
+        struct vm;
+        int yakvm_create_io(struct vm *vm);
+        void yakvm_destroy_io(struct vm *vm);
+        void yakvm_io_drain(struct vm *vm);
+
+#endif // __YAKVM_TOOL_IO_H_
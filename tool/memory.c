@@ -1,6 +1,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -8,8 +9,8 @@
 #include "memory.h"
 #include "../include/memory.h"
 
-/* load the bin to *YAKVM_ENTRY* */
-static int yakvm_load_bin(uint8_t *memory, const char *bin)
+/* load the bin to *YAKVM_ENTRY*, and return its size in @size */
+static int yakvm_load_bin(uint8_t *memory, const char *bin, size_t *size)
 {
         int fd, ret = 0;
         struct stat stat;
@@ -45,6 +46,7 @@ static int yakvm_load_bin(uint8_t *memory, const char *bin)
         }
         assert(ret == stat.st_size);
 
+        *size = stat.st_size;
         ret = 0;
 
 close_fd:
@@ -53,12 +55,46 @@ out:
         return ret;
 }
 
+/*
+ * populate the NPT for the image and the stacks up front, so the
+ * vcpus never take the *NPF* on the first touch.
+ */
+static int yakvm_prefault_memory(struct vm *vm, size_t size)
+{
+        struct prefault_range ranges[] = {
+                {.gpa = YAKVM_ENTRY, .size = size},
+                {.gpa = YAKVM_STACK, .size = PAGE_SIZE},
+        };
+        struct prefault args = {
+                .nr_ranges = sizeof(ranges) / sizeof(ranges[0]),
+                .ranges = (unsigned long)ranges,
+        };
+        int ret;
+
+        ret = ioctl(vm->vmfd, YAKVM_PREFAULT, &args);
+        if (ret < 0) {
+                ret = errno;
+                log(LOG_ERR, "ioctl(YAKVM_PREFAULT) failed with error %s",
+                    strerror(errno));
+                return ret;
+        }
+
+        return 0;
+}
+
+/*
+ * back the guest ram with the anonymous memory of the emulator,
+ * which is pinned by the kernel when the guest touches it.
+ */
 int yakvm_create_memory(struct vm *vm, const char *bin)
 {
+        struct memory_region region;
+        size_t size;
         int ret = 0;
 
         vm->memory = mmap(NULL, YAKVM_MEMORY, PROT_READ | PROT_WRITE,
-                         MAP_SHARED, vm->vmfd, 0);
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                          -1, 0);
         if (vm->memory == MAP_FAILED) {
                 ret = errno;
                 log(LOG_ERR, "mmap() failed with error %s",
@@ -66,13 +102,35 @@ int yakvm_create_memory(struct vm *vm, const char *bin)
                 goto out;
         }
 
-        ret = yakvm_load_bin(vm->memory, bin);
+        /* the region shadows the whole kernel ram of the vm */
+        region = (struct memory_region) {
+                .slot = 0,
+                .gpa = 0,
+                .size = YAKVM_MEMORY,
+                .uaddr = (unsigned long)vm->memory,
+        };
+        ret = ioctl(vm->vmfd, YAKVM_SET_MEMORY_REGION, &region);
+        if (ret < 0) {
+                ret = errno;
+                log(LOG_ERR, "ioctl(YAKVM_SET_MEMORY_REGION) failed "
+                    "with error %s", strerror(errno));
+                goto munmap;
+        }
+
+        ret = yakvm_load_bin(vm->memory, bin, &size);
         if (ret != 0) {
                 log(LOG_ERR, "yakvm_load_bin() "
                     "failed with error %d", ret);
                 goto munmap;
         }
 
+        ret = yakvm_prefault_memory(vm, size);
+        if (ret != 0) {
+                log(LOG_ERR, "yakvm_prefault_memory() "
+                    "failed with error %d", ret);
+                goto munmap;
+        }
+
         return 0;
 
 munmap: